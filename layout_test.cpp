@@ -0,0 +1,51 @@
+#include <iostream>
+#include <string>
+#include "spirelayout.h"
+
+using namespace std;
+
+namespace {
+
+bool check_bounded_damage(const string &upgrades, const string &traps)
+{
+	Layout layout;
+	layout.set_upgrades(TrapUpgrades(upgrades));
+	layout.set_traps(traps);
+
+	Layout exact = layout;
+	exact.update(Layout::FAST);
+
+	layout.update(Layout::UPPER_BOUND);
+	layout.update(Layout::FAST);
+
+	if(layout.get_damage()!=exact.get_damage() || layout.get_runestones_per_second() ||
+		layout.get_low_runestones_per_second() || layout.get_high_runestones_per_second())
+	{
+		cout << "Bound left in a FAST update: " << upgrades << ' ' << traps << endl;
+		return false;
+	}
+
+	return true;
+}
+
+}
+
+/* Checks that layouts which went through UPPER_BOUND before a damage-only update
+don't report the bound as their income.  Exits with a nonzero status on any
+failure. */
+int main()
+{
+	static const char *const cases[][2] =
+	{
+		{ "8886", "FFFFFZZZZZLLLLLPPPPP" },
+		{ "8886", "_____LLZFL_Z___SZKLCLZFPL" },
+		{ "2111", "Z_F_PL_L_F" },
+		{ "6665", "ZZZZZFFFFFSSCCKLLLLLPPPPP" }
+	};
+
+	unsigned failures = 0;
+	for(const auto &c: cases)
+		failures += !check_bounded_damage(c[0], c[1]);
+	cout << (sizeof(cases)/sizeof(cases[0])) << " cases, " << failures << " failures" << endl;
+	return (failures ? 1 : 0);
+}
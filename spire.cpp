@@ -1,9 +1,11 @@
 #include "spire.h"
 #include <signal.h>
 #include <chrono>
+#include <cstdlib>
 #include <functional>
 #include <iomanip>
 #include <iostream>
+#include <new>
 #include <regex>
 #include "console.h"
 #include "getopt.h"
@@ -29,6 +31,53 @@ struct tm *localtime_r(const time_t *timep, struct tm *result)
 }
 #endif
 
+#ifdef COUNT_ALLOCATIONS
+namespace {
+
+// Memory allocations made by the current thread, for benchmarking.
+thread_local unsigned long thread_allocations = 0;
+
+}
+
+/* Array forms call these by default, so replacing the scalar forms is enough
+to count every allocation.  GCC reports mismatched pairs if it can see into
+the replacements, so they are kept out of line. */
+#ifdef __GNUC__
+#define OUT_OF_LINE __attribute__((noinline))
+#else
+#define OUT_OF_LINE
+#endif
+
+OUT_OF_LINE void *operator new(size_t size)
+{
+	++thread_allocations;
+	if(void *ptr = malloc(size ? size : 1))
+		return ptr;
+	throw bad_alloc();
+}
+
+OUT_OF_LINE void *operator new(size_t size, const nothrow_t &) noexcept
+{
+	++thread_allocations;
+	return malloc(size ? size : 1);
+}
+
+OUT_OF_LINE void operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+OUT_OF_LINE void operator delete(void *ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+OUT_OF_LINE void operator delete(void *ptr, const nothrow_t &) noexcept
+{
+	free(ptr);
+}
+#endif
+
 int main(int argc, char **argv)
 {
 	try
@@ -63,7 +112,9 @@ Spire::Spire(int argc, char **argv):
 	cross_rate(500),
 	foreign_rate(500),
 	core_rate(1000),
+	bias_rate(0),
 	heterogeneous(false),
+	pareto(false),
 	n_workers(4),
 	loops_per_cycle(200),
 	cycle(1),
@@ -80,6 +131,26 @@ Spire::Spire(int argc, char **argv):
 	connection(0),
 	athome_boredom(500000),
 	next_work(0),
+	benchmark_cycles(0),
+	kernel_benchmark(false),
+	pool_benchmark(false),
+	worker_allocations(0),
+	cache(0),
+	floor_memo_bits(10),
+	memo_lookups(0),
+	memo_hits(0),
+	bound_filter(false),
+	bound_checks(0),
+	bound_rejects(0),
+	bound_tightness(0),
+	bound_samples(0),
+	staged_income(false),
+	stage_margin(0),
+	income_samples(0),
+	stage_estimates(0),
+	stage_skips(0),
+	pool_offers(0),
+	pool_duplicates(0),
 	intr_flag(false),
 	budget(0),
 	core_budget(0),
@@ -111,6 +182,8 @@ Spire::Spire(int argc, char **argv):
 	unsigned keep_core_mods = 0;
 	std::string tower_type;
 	unsigned towers_seen = 0;
+	unsigned cache_bits = 18;
+	unsigned stage_margin_seen = 0;
 
 	GetOpt getopt;
 	getopt.add_option('b', "budget", budget_str, GetOpt::REQUIRED_ARG).set_help("Maximum amount of runestones to spend", "NUM");
@@ -140,16 +213,26 @@ Spire::Spire(int argc, char **argv):
 	getopt.add_option("extinction-interval", extinction_interval, GetOpt::REQUIRED_ARG).set_help("Interval between extinctions, in cycles", "NUM").bind_seen_count(extinction_interval_seen);
 	getopt.add_option("isolation-period", isolation_period, GetOpt::REQUIRED_ARG).set_help("Isolation period after extinction, in cycles", "NUM").bind_seen_count(isolation_period_seen);
 	getopt.add_option("heterogeneous", heterogeneous, GetOpt::NO_ARG).set_help("Use heterogeneous pool configurations");
+	getopt.add_option("pareto", pareto, GetOpt::NO_ARG).set_help("Keep layouts not beaten in damage, income, towers and cost together");
 	getopt.add_option('r', "cross-rate", cross_rate, GetOpt::REQUIRED_ARG).set_help("Probability of crossing two layouts (out of 1000)", "NUM");
 	getopt.add_option('o', "foreign-rate", foreign_rate, GetOpt::REQUIRED_ARG).set_help("Probability of crossing from another pool (out of 1000)", "NUM").bind_seen_count(foreign_rate_seen);
 	getopt.add_option("core-rate", core_rate, GetOpt::REQUIRED_ARG).set_help("Probability of mutating the core (out of 1000)", "NUM");
+	getopt.add_option("bias-rate", bias_rate, GetOpt::REQUIRED_ARG).set_help("Probability of mutating the least contributing cells (out of 1000)", "NUM");
 	getopt.add_option('g', "debug-layout", debug_layout, GetOpt::NO_ARG).set_help("Print detailed information about the layout");
 	getopt.add_option("show-pools", show_pools, GetOpt::NO_ARG).set_help("Show population pool contents while running");
 	getopt.add_option("raw-values", raw_values, GetOpt::NO_ARG).set_help("Display raw numeric values");
+	getopt.add_option("cache-bits", cache_bits, GetOpt::REQUIRED_ARG).set_help("Size of the result cache as a power of two, up to 26, or 0 to disable it (18 uses 14 MB)", "NUM");
+	getopt.add_option("floor-memo-bits", floor_memo_bits, GetOpt::REQUIRED_ARG).set_help("Size of the per-thread table of built floors as a power of two, or 0 to disable it", "NUM");
+	getopt.add_option("bound-filter", bound_filter, GetOpt::NO_ARG).set_help("Skip simulating layouts whose upper bound shows they can't enter the pool");
+	getopt.add_option("stage-margin", stage_margin, GetOpt::REQUIRED_ARG).set_help("Estimate income first and fully evaluate layouts within this many percent of entering the pool", "PCT").bind_seen_count(stage_margin_seen);
+	getopt.add_option("approx-income", income_samples, GetOpt::REQUIRED_ARG).set_help("Approximate income from this many sample enemies", "NUM");
+	getopt.add_option("benchmark", benchmark_cycles, GetOpt::REQUIRED_ARG).set_help("Run for a number of cycles and report performance", "NUM");
+	getopt.add_option("benchmark-kernels", kernel_benchmark, GetOpt::NO_ARG).set_help("Compare specialized and generic simulation kernels");
+	getopt.add_option("benchmark-pools", pool_benchmark, GetOpt::NO_ARG).set_help("Measure pool throughput with increasing numbers of threads");
 	getopt.add_argument("layout", layout_str, GetOpt::OPTIONAL_ARG).set_help("Layout to start with");
 	getopt(argc, argv);
 
-	if(floors_seen && floors<1)
+	if(floors_seen && (floors<1 || floors>TrapArray::MAX_FLOORS))
 		throw usage_error("Invalid number of floors");
 	if(n_workers<1)
 		throw usage_error("Invalid number of worker threads");
@@ -161,6 +244,16 @@ Spire::Spire(int argc, char **argv):
 		throw usage_error("Invalid number of pools");
 	if(prune_limit<1)
 		throw usage_error("Invalid prune limit");
+	if(cache_bits>26)
+		throw usage_error("Invalid cache size");
+	if(floor_memo_bits>24)
+		throw usage_error("Invalid floor memo size");
+	if(income_samples==1)
+		throw usage_error("Invalid number of income samples");
+
+	if(cache_bits)
+		cache = new LayoutCache(cache_bits);
+	staged_income = (stage_margin_seen>0);
 
 	if(athome)
 	{
@@ -235,11 +328,16 @@ Spire::Spire(int argc, char **argv):
 	else if(income)
 		score_func = income_score;
 
-	if(income)
-		update_mode = Layout::FULL;
+	// Archives compare layouts by both damage and income.
+	if(income || pareto)
+		update_mode = (income_samples ? Layout::APPROX_INCOME : Layout::FULL);
 	else if(exact)
 		update_mode = Layout::EXACT_DAMAGE;
 
+	// Staging only applies to exact income evaluation against a single score.
+	if(staged_income && !athome && (!income || income_samples || pareto))
+		throw usage_error("--stage-margin requires --income without --approx-income or --pareto");
+
 	if(keep_core_mods)
 	{
 		core_mutate = Core::VALUES_ONLY;
@@ -283,7 +381,7 @@ Spire::Spire(int argc, char **argv):
 		else if(budget<start_layout.get_cost())
 			throw usage_error("Runestone budget is too low for the layout");
 	}
-	else if(!start_layout.get_traps().empty())
+	else if(start_layout.get_floors())
 		budget = start_layout.get_cost();
 	else
 		budget = 1000000;
@@ -441,9 +539,9 @@ void Spire::init_pools(unsigned pool_size)
 {
 	pools.reserve(n_pools);
 	for(unsigned i=0; i<n_pools; ++i)
-		pools.push_back(new Pool(pool_size, score_func));
+		pools.push_back(new Pool(pool_size, score_func, pareto));
 
-	unsigned floors = start_layout.get_traps().size()/5;
+	unsigned floors = start_layout.get_floors();
 	uint8_t downgrade[4] = { };
 	for(unsigned i=0; i<pools.size(); ++i)
 	{
@@ -523,6 +621,7 @@ Spire::~Spire()
 {
 	for(auto p: pools)
 		delete p;
+	delete cache;
 }
 
 int Spire::main()
@@ -536,6 +635,18 @@ int Spire::main()
 		return 0;
 	}
 
+	if(kernel_benchmark)
+	{
+		run_kernel_benchmark();
+		return 0;
+	}
+
+	if(pool_benchmark)
+	{
+		run_pool_benchmark();
+		return 0;
+	}
+
 	if(show_pools || fancy_output)
 	{
 		console.clear_screen();
@@ -562,7 +673,7 @@ int Spire::main()
 			if(!fancy_output)
 				console << "Database returned no better layout" << endl;
 
-			submit_best();
+			submit(best_layout);
 		}
 	}
 
@@ -574,6 +685,8 @@ int Spire::main()
 
 	chrono::steady_clock::time_point period_start_time = chrono::steady_clock::now();
 	unsigned period_start_cycle = cycle;
+	chrono::steady_clock::time_point benchmark_start_time = period_start_time;
+	unsigned benchmark_start_cycle = period_start_cycle;
 	bool leave_loop = false;
 	while(!leave_loop)
 	{
@@ -585,6 +698,9 @@ int Spire::main()
 		period_start_time = current_time;
 		period_start_cycle = period_end_cycle;
 
+		if(benchmark_cycles && period_end_cycle-benchmark_start_cycle>=benchmark_cycles)
+			intr_flag = true;
+
 		if(intr_flag)
 		{
 			for(auto w: workers)
@@ -612,15 +728,160 @@ int Spire::main()
 		cout.flush();
 	}
 
+	if(benchmark_cycles)
+	{
+		// Workers have finished all cycles they started by the time they're joined.
+		float secs = chrono::duration<float>(chrono::steady_clock::now()-benchmark_start_time).count();
+		unsigned long loops = static_cast<unsigned long>(cycle-benchmark_start_cycle)*loops_per_cycle;
+		cout << "Benchmark: " << loops << " loops in " << fixed << setprecision(2) << secs << " seconds, "
+			<< static_cast<unsigned long>(loops/secs) << " loops/sec";
+#ifdef COUNT_ALLOCATIONS
+		cout << ", " << static_cast<double>(worker_allocations)/loops << " allocations/loop";
+#endif
+		if(memo_lookups)
+			cout << ", " << memo_hits*100/memo_lookups << "% floor memo hits";
+		if(bound_checks)
+		{
+			cout << ", " << bound_rejects*100/bound_checks << "% rejected by bound";
+			if(bound_samples)
+				cout << " (" << bound_tightness/bound_samples/10 << "% tight)";
+		}
+		if(stage_estimates)
+			cout << ", " << stage_skips*100/stage_estimates << "% full evaluations avoided";
+		if(pool_offers)
+			cout << ", " << pool_duplicates*100/pool_offers << "% duplicates";
+		cout << endl;
+	}
+
 	return 0;
 }
 
+void Spire::run_kernel_benchmark()
+{
+	unsigned floors = start_layout.get_floors();
+	const unsigned n_layouts = 5000;
+	const unsigned n_rounds = 10;
+	Random random(1);
+	vector<Layout> specialized(n_layouts);
+	vector<Layout> generic(n_layouts);
+	for(const TrapUpgrades *upg=TrapUpgrades::canonical; upg->fire; ++upg)
+	{
+		string allowed = "_FZS";
+		if(upg->poison)
+			allowed += "PC";
+		if(upg->lightning)
+			allowed += "LK";
+
+		for(unsigned i=0; i<n_layouts; ++i)
+		{
+			string traps(floors*5, '_');
+			for(char &t: traps)
+				t = allowed[random()%allowed.size()];
+			specialized[i].set_upgrades(*upg);
+			specialized[i].set_core(start_layout.get_core());
+			specialized[i].set_traps(traps, floors);
+			generic[i] = specialized[i];
+			generic[i].use_generic_kernel();
+		}
+
+		/* Warm up both kernels on copies which are thrown away, then time them
+		in rounds, alternating which one goes first.  Whichever runs first would
+		otherwise pay for bringing code and data into the caches. */
+		for(unsigned i=0; i<n_layouts/n_rounds; ++i)
+		{
+			Layout layout = generic[i];
+			layout.update(update_mode);
+			layout = specialized[i];
+			layout.update(update_mode);
+		}
+
+		float generic_secs = 0;
+		float specialized_secs = 0;
+		for(unsigned i=0; i<n_rounds*2; ++i)
+		{
+			unsigned round = i/2;
+			bool use_generic = ((round+i)%2==0);
+			vector<Layout> &layouts = (use_generic ? generic : specialized);
+			chrono::steady_clock::time_point start_time = chrono::steady_clock::now();
+			for(unsigned j=round*n_layouts/n_rounds; j<(round+1)*n_layouts/n_rounds; ++j)
+				layouts[j].update(update_mode);
+			float secs = chrono::duration<float>(chrono::steady_clock::now()-start_time).count();
+			(use_generic ? generic_secs : specialized_secs) += secs;
+		}
+
+		unsigned mismatches = 0;
+		for(unsigned i=0; i<n_layouts; ++i)
+			if(specialized[i].get_damage()!=generic[i].get_damage() || specialized[i].get_runestones_per_second()!=generic[i].get_runestones_per_second())
+				++mismatches;
+
+		cout << upg->str() << ": generic " << fixed << setprecision(2) << generic_secs*1e6/n_layouts << " us, specialized "
+			<< specialized_secs*1e6/n_layouts << " us, speedup " << generic_secs/specialized_secs;
+		if(mismatches)
+			cout << ", " << mismatches << " mismatches";
+		cout << endl;
+	}
+}
+
+void Spire::run_pool_benchmark()
+{
+	unsigned floors = start_layout.get_floors();
+	const unsigned n_layouts = 2000;
+	const unsigned n_loops = 400000;
+	Random random(1);
+	string allowed = "_FZS";
+	if(start_layout.get_upgrades().poison)
+		allowed += "PC";
+	if(start_layout.get_upgrades().lightning)
+		allowed += "LK";
+
+	vector<Layout> layouts(n_layouts);
+	for(auto &l: layouts)
+	{
+		string traps(floors*5, '_');
+		for(char &t: traps)
+			t = allowed[random()%allowed.size()];
+		l.set_upgrades(start_layout.get_upgrades());
+		l.set_core(start_layout.get_core());
+		l.set_traps(traps, floors);
+		l.update(update_mode);
+	}
+
+	/* Each loop picks a parent and offers a candidate like a worker would,
+	without the evaluation in between.  Thread counts beyond the number of
+	cores only show the cost of contention, not scaling. */
+	Pool &pool = *pools.front();
+	cout << thread::hardware_concurrency() << " cores available" << endl;
+	for(unsigned n_threads=1; n_threads<=64; n_threads*=2)
+	{
+		pool.reset();
+		for(unsigned i=0; i<n_layouts; i+=10)
+			pool.add_layout(layouts[i]);
+
+		vector<thread> threads;
+		chrono::steady_clock::time_point start_time = chrono::steady_clock::now();
+		for(unsigned i=0; i<n_threads; ++i)
+			threads.emplace_back([&pool, &layouts, i, n_threads]{
+				Random thread_random(i+1);
+				for(unsigned j=0; j<n_loops/n_threads; ++j)
+				{
+					Layout parent = pool.get_random_layout(thread_random);
+					pool.add_layout(layouts[thread_random()%layouts.size()]);
+				}
+			});
+		for(auto &t: threads)
+			t.join();
+
+		float secs = chrono::duration<float>(chrono::steady_clock::now()-start_time).count();
+		cout << n_threads << " threads: " << static_cast<unsigned long>(n_loops/secs) << " loops/sec" << endl;
+	}
+}
+
 bool Spire::query_network()
 {
 	if(!connection)
 		return false;
 
-	unsigned floors = best_layout.get_traps().size()/5;
+	unsigned floors = best_layout.get_floors();
 	string query = format("query upg=%s f=%s rs=%s", best_layout.get_upgrades().str(), floors, budget);
 	if(best_layout.get_core().tier>=0)
 		query += format(" core=%s", best_layout.get_core().str(true));
@@ -657,9 +918,22 @@ bool Spire::query_network()
 	return false;
 }
 
+bool Spire::check_network_reply(const vector<string> &args)
+{
+	// Layouts arriving without a floor count take it from the traps.
+	for(const auto &arg: args)
+		if(!arg.compare(0, 2, "t=") && arg.size()-2>TrapArray::MAX_FLOORS*5)
+		{
+			console << "Ignoring a layout from the database with more than " << TrapArray::MAX_FLOORS << " floors" << endl;
+			return false;
+		}
+
+	return true;
+}
+
 void Spire::process_network_reply(const vector<string> &args, Layout &layout)
 {
-	unsigned floors = layout.get_traps().size()/5;
+	unsigned floors = layout.get_floors();
 
 	Core received_core;
 
@@ -750,7 +1024,7 @@ void Spire::check_reconnect(const chrono::steady_clock::time_point &current_time
 				report(best_layout, "New best layout from database");
 		}
 		else
-			submit_best();
+			submit(best_layout);
 	}
 }
 
@@ -769,19 +1043,30 @@ bool Spire::check_results()
 	bool new_best = false;
 	for(auto *p: pools)
 	{
-		if(p->get_best_layout(best_layout))
-			new_best = true;
+		// Pools may hold approximate values, so candidates are compared exactly.
+		Layout layout = best_layout;
+		if(p->get_best_layout(layout))
+		{
+			layout.update(Layout::FULL);
+			if(score_func(layout)>score_func(best_layout))
+			{
+				best_layout = layout;
+				new_best = true;
+			}
+		}
 		if(heterogeneous)
 			break;
 	}
 
 	if(new_best)
 	{
-		best_layout.update(Layout::FULL);
 		next_work = best_layout.get_cycle()+athome_boredom;
-		submit_best();
+		submit(best_layout);
 	}
 
+	if(pareto)
+		check_extremes();
+
 	if(next_prune && cycle>=next_prune)
 		prune_pools();
 	if(next_extinction && cycle>=next_extinction)
@@ -790,15 +1075,58 @@ bool Spire::check_results()
 	return new_best;
 }
 
-void Spire::submit_best()
+void Spire::check_extremes()
 {
-	if(!network || !score_func(best_layout))
+	// The same objectives the database keeps best layouts for.
+	static Pool::ScoreFunc *const objectives[4] =
+	{
+		&damage_score,
+		&income_score,
+		&towers_score<damage_score, 0x40404>,
+		&towers_score<income_score, 0x40404>
+	};
+	static const char *const names[4] = { "damage", "income", "towers/damage", "towers/income" };
+
+	for(unsigned i=0; i<4; ++i)
+	{
+		// The main search already reports and submits the selected goal.
+		if(objectives[i]==score_func)
+			continue;
+
+		Layout &extreme = extreme_layouts[i];
+		bool new_extreme = false;
+		for(auto *p: pools)
+		{
+			Layout layout = extreme;
+			if(p->get_best_layout(layout, objectives[i]))
+			{
+				layout.update(Layout::FULL);
+				if(objectives[i](layout)>objectives[i](extreme))
+				{
+					extreme = layout;
+					new_extreme = true;
+				}
+			}
+		}
+
+		if(new_extreme)
+		{
+			submit(extreme);
+			if(!show_pools)
+				report(extreme, format("New best %s layout in archive", names[i]));
+		}
+	}
+}
+
+void Spire::submit(const Layout &layout)
+{
+	if(!network || !score_func(layout))
 		return;
 
-	string submit = format("submit upg=%s t=%s", best_layout.get_upgrades().str(), best_layout.get_traps());
-	if(best_layout.get_core().tier>=0)
-		submit += format(" core=%s", best_layout.get_core().str(true));
-	network->send_message(connection, submit);
+	string message = format("submit upg=%s t=%s", layout.get_upgrades().str(), layout.get_traps());
+	if(layout.get_core().tier>=0)
+		message += format(" core=%s", layout.get_core().str(true));
+	network->send_message(connection, message);
 }
 
 void Spire::update_output(bool new_best_found)
@@ -822,7 +1150,31 @@ void Spire::update_output(bool new_best_found)
 			}
 		}
 
-		console << loops_per_second << " loops/sec" << endl_clear;
+		console << loops_per_second << " loops/sec";
+		if(cache)
+		{
+			unsigned long lookups = cache->get_lookups();
+			if(lookups)
+				console << ", " << cache->get_hits()*100/lookups << "% cache hits";
+		}
+		unsigned long floor_lookups = memo_lookups.load(memory_order_relaxed);
+		if(floor_lookups)
+			console << ", " << memo_hits.load(memory_order_relaxed)*100/floor_lookups << "% floor memo hits";
+		unsigned long checks = bound_checks.load(memory_order_relaxed);
+		if(checks)
+		{
+			unsigned long samples = bound_samples.load(memory_order_relaxed);
+			console << ", " << bound_rejects.load(memory_order_relaxed)*100/checks << "% rejected by bound";
+			if(samples)
+				console << " (" << bound_tightness.load(memory_order_relaxed)/samples/10 << "% tight)";
+		}
+		unsigned long estimates = stage_estimates.load(memory_order_relaxed);
+		if(estimates)
+			console << ", " << stage_skips.load(memory_order_relaxed)*100/estimates << "% full evaluations avoided";
+		unsigned long offers = pool_offers.load(memory_order_relaxed);
+		if(offers)
+			console << ", " << pool_duplicates.load(memory_order_relaxed)*100/offers << "% duplicates";
+		console << endl_clear;
 	}
 	else
 	{
@@ -908,7 +1260,7 @@ void Spire::extinct_pools(Number score_limit)
 		Layout empty;
 		empty.set_upgrades(pool_best.get_upgrades());
 		empty.set_core(pool_best.get_core());
-		empty.set_traps(string(), pool_best.get_traps().size()/5);
+		empty.set_traps(string(), pool_best.get_floors());
 
 		pool->reset(0);
 		pool->add_layout(empty);
@@ -940,6 +1292,9 @@ void Spire::receive(Network::ConnectionTag, const string &message)
 	string cmd = parts.front();
 	parts.erase(parts.begin());
 
+	if((cmd=="push" || cmd=="work") && !check_network_reply(parts))
+		return;
+
 	if(cmd=="push")
 	{
 		Layout layout;
@@ -975,9 +1330,9 @@ void Spire::receive(Network::ConnectionTag, const string &message)
 		Layout empty;
 		empty.set_upgrades(layout.get_upgrades());
 		empty.set_core(layout.get_core());
-		empty.set_traps(string(), layout.get_traps().size()/5);
+		empty.set_traps(string(), layout.get_floors());
 
-		update_mode = (income ? Layout::FULL : Layout::FAST);
+		update_mode = (income || pareto ? (income_samples ? Layout::APPROX_INCOME : Layout::FULL) : Layout::FAST);
 		if(towers)
 			score_func = (income ? &towers_score<income_score, 0x40404> : &towers_score<damage_score, 0x40404>);
 		else
@@ -994,6 +1349,8 @@ void Spire::receive(Network::ConnectionTag, const string &message)
 		{
 			lock_guard<mutex> lock(best_mutex);
 			best_layout = layout;
+			for(Layout &l: extreme_layouts)
+				l = Layout();
 		}
 		budget = max(budget, layout.get_cost());
 
@@ -1119,7 +1476,10 @@ bool Spire::print(const Layout &layout, unsigned &count)
 	if(show_pools)
 	{
 		console.clear_current_line();
-		console << descr << ' ' << score_func(layout) << ' ' << layout.get_cost() << ' ' << layout.get_cycle() << endl;
+		console << descr << ' ' << score_func(layout);
+		if(layout.get_low_runestones_per_second()<layout.get_high_runestones_per_second())
+			console << " (" << layout.get_low_runestones_per_second() << '-' << layout.get_high_runestones_per_second() << " Rs/s)";
+		console << ' ' << layout.get_cost() << ' ' << layout.get_cycle() << endl;
 	}
 	else if(fancy_output && athome)
 		console << descr << endl_clear;
@@ -1269,8 +1629,9 @@ template<Pool::ScoreFunc *base_func, uint32_t towers_mask>
 Number Spire::towers_score(const Layout &layout)
 {
 	Number count = 0;
-	for(const char c: layout.get_traps())
-		if(towers_mask&(1<<(c-'A')))
+	unsigned cells = layout.get_floors()*5;
+	for(unsigned i=0; i<cells; ++i)
+		if(towers_mask&(1<<(layout.get_trap(i)-'A')))
 			++count;
 	return (base_func(layout)>>6) + (count<<(sizeof(Number)*8-6));
 }
@@ -1349,6 +1710,17 @@ void Spire::Worker::join()
 void Spire::Worker::main()
 {
 	unique_lock<mutex> pools_lock(spire.pools_mutex, defer_lock);
+	LayoutBatch batch;
+	vector<Number> bounds;
+	vector<const Layout *> accepted;
+	Pool::AdmissionFilter admission;
+	Layout::UndoLog undo_log;
+	double contributions[TrapArray::MAX_FLOORS*5];
+	Layout::UpdateContext update_context;
+	update_context.set_cache(spire.cache);
+	update_context.set_floor_memo(spire.floor_memo_bits);
+	if(spire.income_samples)
+		update_context.set_income_samples(spire.income_samples);
 	while(1)
 	{
 		unique_lock<mutex> state_lock(state_mutex);
@@ -1401,42 +1773,146 @@ void Spire::Worker::main()
 			{
 				cross_layout = cross_pool->get_random_layout(random);
 				if(!do_cross)
-					base_layout.set_traps(cross_layout.get_traps(), base_layout.get_traps().size()/5);
+					base_layout.set_traps(cross_layout.get_traps(), base_layout.get_floors());
 			}
 		}
 		else
 			pools_lock.unlock();
 
+		/* An upper bound of the score is cheap to compute compared to the
+		simulation.  Layouts which couldn't get into the pool even with their
+		bound are rejected early.  The pool only gets better, so filtering
+		against an older state of it is safe. */
+		bool staged = (spire.staged_income && spire.update_mode==Layout::FULL);
+		pool.get_admission_filter(admission);
+		unsigned long checks = 0;
+		unsigned long rejects = 0;
+		unsigned long tightness = 0;
+		unsigned long samples = 0;
+		unsigned long estimates = 0;
+		unsigned long skips = 0;
+
+		/* Candidates are generated in place in the base layout and rolled back
+		afterwards.  The ones which pass the cheap checks are recorded in the
+		batch without their steps. */
+		if(spire.bias_rate)
+			base_layout.get_cell_contributions(contributions, update_context);
+		base_layout.record_undo(undo_log);
+		batch.clear();
+		bounds.clear();
+		accepted.clear();
 		for(unsigned i=0; i<spire.loops_per_cycle; ++i)
 		{
-			Layout mutated = base_layout;
+			if(i)
+				base_layout.undo(undo_log);
+
 			if(do_cross)
-				mutated.cross_from(cross_layout, random);
+				base_layout.cross_from(cross_layout, random);
 
-			unsigned cells = mutated.get_traps().size();
+			unsigned cells = base_layout.get_floors()*5;
 			unsigned mut_count = 1+random()%cells;
 			mut_count = max((mut_count*mut_count)/cells, 1U);
-			mutated.mutate(static_cast<Layout::MutateMode>(random()%3), mut_count, random, cycle);
-			if(!mutated.is_valid())
+			Layout::MutateMode mut_mode = static_cast<Layout::MutateMode>(random()%3);
+			if(spire.bias_rate && random()%1000<spire.bias_rate)
+				mut_mode = Layout::BIASED;
+			base_layout.mutate(mut_mode, mut_count, random, cycle, contributions);
+			if(!base_layout.is_valid())
 				continue;
 
-			mutated.update(Layout::COST_ONLY);
-			if(mutated.get_cost()>spire.budget)
+			base_layout.update(Layout::COST_ONLY);
+			if(base_layout.get_cost()>spire.budget)
 				continue;
 
 			if(spire.core_rate && random()%1000<spire.core_rate)
 			{
-				Core core = mutated.get_core();
+				Core core = base_layout.get_core();
 				core.mutate(spire.core_mutate, 1+random()%5, random);
 				core.update();
 
 				if(spire.validate_core(core))
-					mutated.set_core(core);
+					base_layout.set_core(core);
 			}
 
-			mutated.update(spire.update_mode);
-			pool.add_layout(mutated);
+			Number bound = 0;
+			if(spire.bound_filter && !admission.empty())
+			{
+				base_layout.update(Layout::UPPER_BOUND);
+				bound = spire.score_func(base_layout);
+				++checks;
+				if(!admission.accepts(bound, base_layout.get_cost()))
+				{
+					++rejects;
+					continue;
+				}
+			}
+
+			batch.add(base_layout);
+			bounds.push_back(bound);
 		}
+
+		/* The base layout evaluates the candidates in turn, rebuilding steps
+		only from where each differs from the previous one. */
+		staged = (staged && !admission.empty());
+		for(unsigned i=0; i<batch.size(); ++i)
+		{
+			batch.load(i, base_layout);
+			base_layout.update((staged ? Layout::APPROX_INCOME : spire.update_mode), update_context);
+			if(staged)
+			{
+				// Only layouts which come close to being accepted get the full evaluation.
+				Number score = spire.score_func(base_layout);
+				Number slack = score/100*spire.stage_margin;
+				++estimates;
+				if(!admission.accepts((score+slack<score ? number_max : score+slack), base_layout.get_cost()))
+				{
+					++skips;
+					continue;
+				}
+				base_layout.update(Layout::FULL, update_context);
+			}
+
+			if(bounds[i])
+			{
+				tightness += static_cast<double>(spire.score_func(base_layout))*1000/bounds[i];
+				++samples;
+			}
+
+			// The pool would turn these down too, so they aren't worth copying.
+			if(!admission.empty() && !admission.accepts(spire.score_func(base_layout), base_layout.get_cost()))
+				continue;
+			batch.keep(base_layout);
+		}
+
+		for(unsigned i=0; i<batch.get_kept_count(); ++i)
+			accepted.push_back(&batch.get_kept(i));
+
+		// Merging the whole cycle at once publishes at most one new snapshot.
+		unsigned duplicates = pool.add_layouts(accepted);
+
+		if(checks)
+		{
+			spire.bound_checks.fetch_add(checks, memory_order_relaxed);
+			spire.bound_rejects.fetch_add(rejects, memory_order_relaxed);
+			spire.bound_tightness.fetch_add(tightness, memory_order_relaxed);
+			spire.bound_samples.fetch_add(samples, memory_order_relaxed);
+		}
+		if(estimates)
+		{
+			spire.stage_estimates.fetch_add(estimates, memory_order_relaxed);
+			spire.stage_skips.fetch_add(skips, memory_order_relaxed);
+		}
+		spire.pool_offers.fetch_add(accepted.size(), memory_order_relaxed);
+		spire.pool_duplicates.fetch_add(duplicates, memory_order_relaxed);
+#ifdef COUNT_ALLOCATIONS
+		spire.worker_allocations.fetch_add(thread_allocations, memory_order_relaxed);
+		thread_allocations = 0;
+#endif
+		update_context.flush_cache_stats();
+		unsigned long memo_lookups;
+		unsigned long memo_hits;
+		update_context.take_memo_stats(memo_lookups, memo_hits);
+		spire.memo_lookups.fetch_add(memo_lookups, memory_order_relaxed);
+		spire.memo_hits.fetch_add(memo_hits, memory_order_relaxed);
 	}
 }
 
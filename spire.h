@@ -9,6 +9,7 @@
 #include <vector>
 #include "console.h"
 #include "network.h"
+#include "spirecache.h"
 #include "spirelayout.h"
 #include "spirepool.h"
 #include "types.h"
@@ -74,7 +75,9 @@ private:
 	unsigned cross_rate;
 	unsigned foreign_rate;
 	unsigned core_rate;
+	unsigned bias_rate;
 	bool heterogeneous;
+	bool pareto;
 	unsigned n_workers;
 	std::list<Worker *> workers;
 	unsigned loops_per_cycle;
@@ -93,6 +96,26 @@ private:
 	std::chrono::steady_clock::time_point reconnect_timeout;
 	unsigned athome_boredom;
 	unsigned next_work;
+	unsigned benchmark_cycles;
+	bool kernel_benchmark;
+	bool pool_benchmark;
+	std::atomic<unsigned long> worker_allocations;
+	LayoutCache *cache;
+	unsigned floor_memo_bits;
+	std::atomic<unsigned long> memo_lookups;
+	std::atomic<unsigned long> memo_hits;
+	bool bound_filter;
+	std::atomic<unsigned long> bound_checks;
+	std::atomic<unsigned long> bound_rejects;
+	std::atomic<unsigned long> bound_tightness;
+	std::atomic<unsigned long> bound_samples;
+	bool staged_income;
+	unsigned stage_margin;
+	unsigned income_samples;
+	std::atomic<unsigned long> stage_estimates;
+	std::atomic<unsigned long> stage_skips;
+	std::atomic<unsigned long> pool_offers;
+	std::atomic<unsigned long> pool_duplicates;
 	bool intr_flag;
 
 	Number budget;
@@ -104,6 +127,8 @@ private:
 	Pool::ScoreFunc *score_func;
 	Layout start_layout;
 	Layout best_layout;
+	// With --pareto, the archive's best layout for each objective of the database.
+	Layout extreme_layouts[4];
 	std::mutex best_mutex;
 
 	Console console;
@@ -124,14 +149,18 @@ public:
 
 	int main();
 private:
+	void run_kernel_benchmark();
+	void run_pool_benchmark();
 	bool query_network();
+	bool check_network_reply(const std::vector<std::string> &);
 	void process_network_reply(const std::vector<std::string> &, Layout &);
 	bool check_better_core(const Layout &, const Core &);
 	bool validate_core(const Core &);
 	void check_reconnect(const std::chrono::steady_clock::time_point &);
 	void check_athome_work();
 	bool check_results();
-	void submit_best();
+	void check_extremes();
+	void submit(const Layout &);
 	void update_output(bool);
 	unsigned get_next_cycle();
 	void prune_pools();
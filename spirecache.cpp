@@ -0,0 +1,49 @@
+#include "spirecache.h"
+#include <cstring>
+
+using namespace std;
+
+LayoutCache::LayoutCache(unsigned size_bits):
+	entries(new Entry[size_t(1)<<size_bits]()),
+	mask((uint64_t(1)<<size_bits)-1),
+	lookups(0),
+	hits(0)
+{ }
+
+bool LayoutCache::lookup(uint64_t key, Values &values) const
+{
+	const Entry &entry = entries[key&mask];
+	uint64_t words[VALUE_WORDS];
+	uint64_t check = entry.check.load(memory_order_relaxed);
+	for(unsigned i=0; i<VALUE_WORDS; ++i)
+	{
+		words[i] = entry.words[i].load(memory_order_relaxed);
+		check ^= words[i];
+	}
+
+	if(check!=key)
+		return false;
+
+	memcpy(&values, words, sizeof(Values));
+	return true;
+}
+
+void LayoutCache::store(uint64_t key, const Values &values)
+{
+	Entry &entry = entries[key&mask];
+	uint64_t words[VALUE_WORDS] = { };
+	memcpy(words, &values, sizeof(Values));
+	uint64_t check = key;
+	for(unsigned i=0; i<VALUE_WORDS; ++i)
+	{
+		entry.words[i].store(words[i], memory_order_relaxed);
+		check ^= words[i];
+	}
+	entry.check.store(check, memory_order_relaxed);
+}
+
+void LayoutCache::add_stats(unsigned long l, unsigned long h)
+{
+	lookups.fetch_add(l, memory_order_relaxed);
+	hits.fetch_add(h, memory_order_relaxed);
+}
@@ -0,0 +1,51 @@
+#ifndef SPIRECACHE_H_
+#define SPIRECACHE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include "types.h"
+
+/* A fixed-size table of layout evaluation results, shared between threads
+without locking.  Entries which map to the same slot overwrite each other.
+Each entry carries a check word derived from its key and contents, so a slot
+which is being written concurrently reads as a miss. */
+class LayoutCache
+{
+public:
+	struct Values
+	{
+		Number damage;
+		Number rs_per_sec;
+		Number rs_per_sec_low;
+		Number rs_per_sec_high;
+		Number rs_per_enemy;
+		std::uint32_t threat;
+	};
+
+private:
+	enum { VALUE_WORDS = (sizeof(Values)+7)/8 };
+
+	struct Entry
+	{
+		std::atomic<std::uint64_t> check;
+		std::atomic<std::uint64_t> words[VALUE_WORDS];
+	};
+
+	std::unique_ptr<Entry[]> entries;
+	std::uint64_t mask;
+	std::atomic<unsigned long> lookups;
+	std::atomic<unsigned long> hits;
+
+public:
+	LayoutCache(unsigned);
+
+	bool lookup(std::uint64_t, Values &) const;
+	void store(std::uint64_t, const Values &);
+
+	void add_stats(unsigned long, unsigned long);
+	unsigned long get_lookups() const { return lookups.load(std::memory_order_relaxed); }
+	unsigned long get_hits() const { return hits.load(std::memory_order_relaxed); }
+};
+
+#endif
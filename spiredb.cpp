@@ -211,6 +211,13 @@ void SpireDB::update_data()
 	for(const auto &row: result)
 	{
 		unsigned id = row[0].as<unsigned>();
+		string traps = row[5].as<string>();
+		if(!check_traps_size(traps))
+		{
+			cout << "Skipping layout " << id << " with more than " << TrapArray::MAX_FLOORS << " floors" << endl;
+			continue;
+		}
+
 		TrapUpgrades upgrades;
 		upgrades.fire = row[1].as<uint16_t>();
 		upgrades.frost = row[2].as<uint16_t>();
@@ -218,7 +225,7 @@ void SpireDB::update_data()
 		upgrades.lightning = row[4].as<uint16_t>();
 		Layout layout;
 		layout.set_upgrades(upgrades);
-		layout.set_traps(row[5].as<string>());
+		layout.set_traps(traps);
 		if (!row[6].is_null())
 			layout.set_core(query_core(xact, row[6].as<unsigned>()));
 		layout.update(Layout::FULL);
@@ -444,7 +451,7 @@ string SpireDB::query(Network::ConnectionTag tag, const vector<string> &args, bo
 	pqxx::work xact(*pq_conn);
 	Layout best = query_layout(xact, floors, upgrades, budget, (core.tier>=0 ? &core : 0), core_budget, income, towers);
 
-	if(!best.get_traps().empty())
+	if(best.get_floors())
 	{
 		string result;
 		result = format("ok upg=%s t=%s", best.get_upgrades().str(), best.get_traps());
@@ -471,6 +478,13 @@ Layout SpireDB::query_layout(pqxx::transaction_base &xact, unsigned floors, cons
 	auto process = [&best, &best_core_id, core, income, towers](const pqxx::result &result){
 		for(const auto &row: result)
 		{
+			string traps = row[5].c_str();
+			if(!check_traps_size(traps))
+			{
+				cout << "Skipping layout " << row[0].c_str() << " with more than " << TrapArray::MAX_FLOORS << " floors" << endl;
+				continue;
+			}
+
 			TrapUpgrades res_upg;
 			res_upg.fire = row[1].as<uint16_t>();
 			res_upg.frost = row[2].as<uint16_t>();
@@ -479,7 +493,7 @@ Layout SpireDB::query_layout(pqxx::transaction_base &xact, unsigned floors, cons
 
 			Layout layout;
 			layout.set_upgrades(res_upg);
-			layout.set_traps(row[5].c_str());
+			layout.set_traps(traps);
 
 			if(core)
 				layout.set_core(*core);
@@ -532,7 +546,12 @@ string SpireDB::submit(Network::ConnectionTag tag, const vector<string> &args)
 		if(!args[i].compare(0, 4, "upg="))
 			layout.set_upgrades(args[i].substr(4));
 		else if(!args[i].compare(0, 2, "t="))
-			layout.set_traps(args[i].substr(2));
+		{
+			string traps = args[i].substr(2);
+			if(!check_traps_size(traps))
+				return format("error toolarge Layouts can have at most %d floors", static_cast<unsigned>(TrapArray::MAX_FLOORS));
+			layout.set_traps(traps);
+		}
 		else if(!args[i].compare(0, 5, "core="))
 		{
 			Core core = args[i].substr(5);
@@ -586,7 +605,7 @@ int SpireDB::submit_layout(Network::ConnectionTag tag, pqxx::transaction_base &x
 
 	if(verdict>0)
 	{
-		unsigned floors = layout.get_traps().size()/5;
+		unsigned floors = layout.get_floors();
 		const TrapUpgrades &upgrades = layout.get_upgrades();
 		Number damage = layout.get_damage();
 		Number rs_per_sec = layout.get_runestones_per_second();
@@ -636,7 +655,7 @@ int SpireDB::submit_layout(Network::ConnectionTag tag, pqxx::transaction_base &x
 
 int SpireDB::check_better_layout(pqxx::transaction_base &xact, const Layout &layout, bool income, bool towers)
 {
-	unsigned floors = layout.get_traps().size()/5;
+	unsigned floors = layout.get_floors();
 	const TrapUpgrades &upgrades = layout.get_upgrades();
 	const Core &core = layout.get_core();
 	Number cost = layout.get_cost();
@@ -657,7 +676,7 @@ int SpireDB::check_better_layout(pqxx::transaction_base &xact, const Layout &lay
 void SpireDB::check_live_queries(Network::ConnectionTag tag, const Layout &layout)
 {
 	string up_str = layout.get_upgrades().str();
-	unsigned floors = layout.get_traps().size()/5;
+	unsigned floors = layout.get_floors();
 	Number cost = layout.get_cost();
 	string core_type = layout.get_core().get_type();
 	int16_t core_tier = layout.get_core().tier;
@@ -698,6 +717,12 @@ int SpireDB::compare_layouts(const Layout &layout1, const Layout &layout2, bool
 		return 0;
 }
 
+bool SpireDB::check_traps_size(const string &traps)
+{
+	// Layouts stored or submitted before TrapArray existed may be longer.
+	return traps.size()<=TrapArray::MAX_FLOORS*5;
+}
+
 void SpireDB::select_random_work()
 {
 	lock_guard<mutex> lock_db(database_mutex);
@@ -749,6 +774,12 @@ void SpireDB::select_random_work()
 	string traps = row[5].c_str();
 	if(work_type==ADD_FLOOR)
 		traps += "_____";
+	if(!check_traps_size(traps))
+	{
+		cout << "Skipping work for " << floors << " floors " << fire << frost << poison << lightning
+			<< " which would exceed " << TrapArray::MAX_FLOORS << " floors" << endl;
+		return;
+	}
 
 	Core core;
 	if(!row[6].is_null())
@@ -769,7 +800,7 @@ void SpireDB::select_random_work()
 			distrib = uniform_real_distribution<double>(-0.1, 0.0);
 		budget = layout.get_cost()*exp(distrib(random));
 
-		layout = query_layout(xact, layout.get_traps().size()/5, upg, budget, (core.tier>=0 ? &core : nullptr), 0, true, (work_type==INCREASE_BUDGET_TOWERS));
+		layout = query_layout(xact, layout.get_floors(), upg, budget, (core.tier>=0 ? &core : nullptr), 0, true, (work_type==INCREASE_BUDGET_TOWERS));
 		traps = layout.get_traps();
 	}
 
@@ -77,6 +77,7 @@ private:
 	int check_better_layout(pqxx::transaction_base &, const Layout &, bool, bool);
 	void check_live_queries(Network::ConnectionTag, const Layout &);
 	static int compare_layouts(const Layout &, const Layout &, bool, bool);
+	static bool check_traps_size(const std::string &);
 	void select_random_work();
 	std::string get_work();
 };
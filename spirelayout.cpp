@@ -1,79 +1,35 @@
 #include "spirelayout.h"
+#include <algorithm>
 #include <cctype>
+#include <cstring>
 #include <iostream>
 #include <iomanip>
 #include <stdexcept>
+#include "wideint.h"
 
 using namespace std;
 
 class WeightedAccumulator
 {
 private:
-	Number high;
-	Number low;
+	DoubleWidth<Number> sum;
 	Number total_weight;
 
-	static constexpr unsigned bits = sizeof(Number)*8;
-	static constexpr unsigned half_bits = bits/2;
-	static constexpr Number low_half_mask = (Number(1)<<half_bits)-1;
-	static constexpr Number high_bit = Number(1)<<(bits-1);
-
 public:
 	WeightedAccumulator();
 
 	void add(Number, Number);
-private:
-	void adc(Number);
-public:
-	Number result() const;
+	Number result() const { return sum.divide(total_weight); }
 };
 
 WeightedAccumulator::WeightedAccumulator():
-	high(0),
-	low(0),
 	total_weight(0)
 { }
 
 void WeightedAccumulator::add(Number n, Number w)
 {
 	total_weight += w;
-	Number nlow = n&low_half_mask;
-	Number nhigh = n>>half_bits;
-	Number wlow = w&low_half_mask;
-	Number whigh = w>>half_bits;
-	Number mid = nlow*whigh+nhigh*wlow;
-	adc(nlow*wlow);
-	adc(mid<<half_bits);
-	high += nhigh*whigh+(mid>>half_bits);
-}
-
-void WeightedAccumulator::adc(Number n)
-{
-	Number l = low;
-	low += n;
-	if(low<l)
-		++high;
-}
-
-Number WeightedAccumulator::result() const
-{
-	Number q = 0;
-	Number r = high;
-	Number bit = high_bit;
-	while(bit)
-	{
-		r <<= 1;
-		if(low&bit)
-			r |= 1;
-		if(r>=total_weight)
-		{
-			q |= bit;
-			r -= total_weight;
-		}
-		bit >>= 1;
-	}
-
-	return q;
+	sum.multiply_add(n, w);
 }
 
 
@@ -286,6 +242,230 @@ TrapEffects::TrapEffects(const TrapUpgrades &upgrades, const Core &core):
 	condenser_bonus = condenser_bonus*(core_scale+core.condenser)/core_scale;
 }
 
+TrapEffects TrapEffects::get(const TrapUpgrades &upgrades, const Core &core)
+{
+	/* A run only sees a few distinct combinations of upgrades and core, so the
+	effects are memoized.  Each thread has its own direct-mapped table, so
+	workers never wait for each other here.  Core mutation can produce many
+	more combinations, which simply evict each other. */
+	typedef array<uint16_t, 11> Key;
+	struct Slot
+	{
+		Key key;
+		TrapEffects effects;
+
+		// Every slot starts out holding the defaults, so all slots are valid.
+		Slot(): key{ 1, 1, 1, 1, 0xFFFF }, effects(TrapUpgrades(), Core()) { }
+	};
+
+	thread_local array<Slot, 64> table;
+
+	Key key =
+	{
+		upgrades.fire, upgrades.frost, upgrades.poison, upgrades.lightning,
+		static_cast<uint16_t>(core.tier), core.fire, core.poison, core.lightning,
+		core.strength, core.condenser, core.runestones
+	};
+
+	uint64_t hash = 0;
+	for(uint16_t k: key)
+		hash = (hash^k)*0x9E3779B97F4A7C15ULL;
+	Slot &slot = table[hash>>58];
+	if(slot.key!=key)
+	{
+		slot.key = key;
+		slot.effects = TrapEffects(upgrades, core);
+	}
+	return slot.effects;
+}
+
+
+namespace {
+
+/* Converts between Number and the number type of a simulation kernel.  The
+maximum value stands for an unbounded hp in both. */
+template<typename T>
+inline T to_kernel(Number n)
+{
+	return (n>=Number(T(-1)) ? T(-1) : T(n));
+}
+
+template<typename T>
+inline Number from_kernel(T n)
+{
+	return (n==T(-1) ? number_max : Number(n));
+}
+
+}
+
+
+const char TrapArray::letters[] = "_FZPLSCK";
+
+namespace {
+
+constexpr array<uint64_t, TrapArray::MAX_FLOORS*5*8> make_zobrist_keys()
+{
+	// Empty cells get a zero key so that a cleared array has a zero hash.
+	array<uint64_t, TrapArray::MAX_FLOORS*5*8> keys{ };
+	uint64_t state = 0x5350495245ULL;
+	for(unsigned i=0; i<keys.size(); ++i)
+	{
+		// Splitmix64
+		state += 0x9E3779B97F4A7C15ULL;
+		uint64_t z = state;
+		z = (z^(z>>30))*0xBF58476D1CE4E5B9ULL;
+		z = (z^(z>>27))*0x94D049BB133111EBULL;
+		if(i%8)
+			keys[i] = z^(z>>31);
+	}
+	return keys;
+}
+
+}
+
+const array<uint64_t, TrapArray::MAX_FLOORS*5*8> TrapArray::zobrist_keys = make_zobrist_keys();
+
+TrapArray::TrapArray():
+	words{ },
+	cells(0),
+	hash(0),
+	counts{ }
+{ }
+
+void TrapArray::assign(const string &t, unsigned floors)
+{
+	if(floors>MAX_FLOORS)
+		throw invalid_argument("TrapArray::assign");
+
+	fill(words, words+MAX_FLOORS/FLOORS_PER_WORD, 0);
+	cells = floors*5;
+	hash = 0;
+	fill(counts, counts+8, 0);
+	counts[0] = cells;
+	for(unsigned i=0; (i<cells && i<t.size()); ++i)
+		set(i, t[i]);
+}
+
+void TrapArray::set(unsigned i, char t)
+{
+	set_code(i, encode(t));
+}
+
+void TrapArray::rotate(unsigned pos, unsigned end)
+{
+	/* Move the trap at end to pos, shifting the ones in between by one cell.
+	This is done a word at a time, carrying the boundary cell from the
+	neighbouring word.  Trap counts are not affected, but the hash is fixed up
+	afterwards from the affected range. */
+	unsigned low = min(pos, end);
+	unsigned high = max(pos, end);
+	uint64_t range_hash = hash_range(low, high);
+	uint64_t other_hash = hash^range_hash;
+	unsigned code = get_code(end);
+	if(end>pos)
+	{
+		for(unsigned w=end/CELLS_PER_WORD; ; --w)
+		{
+			unsigned base = w*CELLS_PER_WORD;
+			unsigned first = max(pos+1, base)-base;
+			unsigned last = end-base;
+			if(last>=CELLS_PER_WORD)
+				last = CELLS_PER_WORD-1;
+			uint64_t mask = ((uint64_t(1)<<(last+1)*3)-1) & ~((uint64_t(1)<<first*3)-1);
+			uint64_t shifted = words[w]<<3;
+			if(base>pos)
+				shifted |= (words[w-1]>>(CELLS_PER_WORD-1)*3)&7;
+			words[w] = (words[w]&~mask) | (shifted&mask);
+			if(base<=pos)
+				break;
+		}
+	}
+	else if(end<pos)
+	{
+		for(unsigned w=end/CELLS_PER_WORD; ; ++w)
+		{
+			unsigned base = w*CELLS_PER_WORD;
+			unsigned first = max(end, base)-base;
+			unsigned last = min(pos-1-base, CELLS_PER_WORD-1U);
+			uint64_t mask = ((uint64_t(1)<<(last+1)*3)-1) & ~((uint64_t(1)<<first*3)-1);
+			uint64_t shifted = words[w]>>3;
+			if(base+CELLS_PER_WORD<=pos)
+				shifted |= (words[w+1]&7)<<(CELLS_PER_WORD-1)*3;
+			words[w] = (words[w]&~mask) | (shifted&mask);
+			if(base+CELLS_PER_WORD>=pos)
+				break;
+		}
+	}
+	put_code(pos, code);
+	hash = other_hash^hash_range(low, high);
+}
+
+uint64_t TrapArray::hash_range(unsigned first, unsigned last) const
+{
+	uint64_t result = 0;
+	for(unsigned i=first; i<=last; ++i)
+		result ^= get_zobrist_key(i, get_code(i));
+	return result;
+}
+
+unsigned TrapArray::get_first_difference(const TrapArray &other) const
+{
+	if(other.cells!=cells)
+		return 0;
+
+	unsigned n_words = get_word_count();
+	for(unsigned i=0; i<n_words; ++i)
+		if(uint64_t diff = words[i]^other.words[i])
+			return i*CELLS_PER_WORD+__builtin_ctzll(diff)/3;
+	return cells;
+}
+
+void TrapArray::decode(char *out) const
+{
+	// Cells are decoded in pairs to reduce the number of lookups.
+	struct PairTable
+	{
+		char pairs[64][2];
+
+		PairTable()
+		{
+			for(unsigned i=0; i<64; ++i)
+			{
+				pairs[i][0] = letters[i&7];
+				pairs[i][1] = letters[i>>3];
+			}
+		}
+	};
+
+	static const PairTable table;
+	const auto &pairs = table.pairs;
+	for(unsigned i=0, w=0; i<cells; ++w)
+	{
+		uint64_t bits = words[w];
+		for(unsigned j=0; (j<FLOORS_PER_WORD && i<cells); ++j, i+=5, bits>>=FLOOR_BITS)
+		{
+			memcpy(out+i, pairs[bits&63], 2);
+			memcpy(out+i+2, pairs[(bits>>6)&63], 2);
+			out[i+4] = letters[(bits>>12)&7];
+		}
+	}
+}
+
+string TrapArray::str() const
+{
+	string result(cells, '_');
+	decode(&result[0]);
+	return result;
+}
+
+unsigned TrapArray::encode(char t)
+{
+	for(unsigned i=1; letters[i]; ++i)
+		if(letters[i]==t)
+			return i;
+	return 0;
+}
+
 
 CellInfo::CellInfo():
 	trap(0),
@@ -296,172 +476,471 @@ CellInfo::CellInfo():
 { }
 
 
-const char Layout::traps[] = "_FZPLSCK";
+const char *const Layout::traps = TrapArray::letters;
 
 Layout::Layout():
+	effects(upgrades, core),
+	steps_column_flags{ },
+	clean_cells(0),
+	steps_generation(0),
+	narrow_steps(false),
 	damage(0),
 	cost(0),
 	rs_per_sec(0),
+	rs_per_sec_low(0),
+	rs_per_sec_high(0),
 	rs_per_enemy(0),
 	threat(0),
-	cycle(0)
-{ }
+	cycle(0),
+	config_hash(0),
+	kernel(get_kernel_features(upgrades))
+{
+	update_config_hash();
+}
 
 void Layout::set_upgrades(const TrapUpgrades &u)
 {
 	upgrades = u;
+	effects = TrapEffects::get(upgrades, core);
+	kernel = get_kernel_features(upgrades);
+	checkpoints.clear();
+	update_config_hash();
 }
 
 void Layout::set_core(const Core &c)
 {
+	// Keep the steps around so the change can be undone, but rebuild them all.
 	core = c;
+	effects = TrapEffects::get(upgrades, core);
+	clean_cells = 0;
+	update_config_hash();
 }
 
 void Layout::set_traps(const string &t, unsigned floors)
 {
-	data = t;
 	if(!floors)
-		floors = (data.size()+4)/5;
-	data.resize(floors*5, '_');
+		floors = (t.size()+4)/5;
+	data.assign(t, floors);
+	checkpoints.clear();
 }
 
 unsigned Layout::get_tower_count() const
 {
 	unsigned count = 0;
-	for(auto c: data)
-		count += (c=='S' || c=='C' || c=='K');
+	unsigned n_words = data.get_word_count();
+	for(unsigned i=0; i<n_words; ++i)
+		count += __builtin_popcountll(data.match(i, TrapArray::encode('S'))|data.match(i, TrapArray::encode('C'))|data.match(i, TrapArray::encode('K')));
 	return count;
 }
 
-void Layout::build_steps(vector<Step> &steps) const
+uint64_t Layout::get_hash() const
+{
+	return data.get_hash()^config_hash^(get_floors()*0x9E3779B97F4A7C15ULL);
+}
+
+void Layout::use_generic_kernel()
+{
+	kernel = GENERIC_KERNEL;
+	checkpoints.clear();
+}
+
+void Layout::update_config_hash()
+{
+	const uint64_t fields[] =
+	{
+		upgrades.fire, upgrades.frost, upgrades.poison, upgrades.lightning,
+		static_cast<uint16_t>(core.tier), core.fire, core.poison, core.lightning,
+		core.strength, core.condenser, core.runestones
+	};
+
+	config_hash = 0;
+	for(uint64_t f: fields)
+	{
+		config_hash = (config_hash^f)*0xBF58476D1CE4E5B9ULL;
+		config_hash ^= config_hash>>29;
+	}
+}
+
+unsigned Layout::get_kernel_features(const TrapUpgrades &upgrades)
+{
+	return (upgrades.fire>=4 ? FIRE_CULLING : 0) |
+		(upgrades.frost>=3 ? FROST_CHILL_BONUS : 0) |
+		(upgrades.frost>=4 ? FROST_POISON_BONUS : 0) |
+		(upgrades.poison>=3 ? POISON_ADJACENT : 0) |
+		(upgrades.poison>=5 ? POISON_BOOST : 0) |
+		(upgrades.lightning>=4 ? LIGHTNING_COLUMNS : 0);
+}
+
+void Layout::get_column_flags(uint8_t *column_flags) const
+{
+	// The cells of a column are at the same positions in every floor.
+	const uint64_t column_mask = 0x0000200040008001ULL;
+	unsigned n_words = data.get_word_count();
+	unsigned lightning = TrapArray::encode('L');
+	fill(column_flags, column_flags+5, 0);
+	for(unsigned i=0; i<n_words; ++i)
+	{
+		uint64_t mask = data.match(i, lightning);
+		for(unsigned j=0; j<5; ++j)
+			column_flags[j] += __builtin_popcountll(mask&(column_mask<<(j*3)));
+	}
+}
+
+template<size_t... F>
+const array<void (Layout::*)(vector<Layout::Step> &, vector<Layout::Checkpoint> &, unsigned, Layout::UpdateContext *) const, sizeof...(F)+1> &Layout::get_build_steps_kernels(index_sequence<F...>)
+{
+	// The generic kernel goes last.
+	static const array<void (Layout::*)(vector<Step> &, vector<Checkpoint> &, unsigned, UpdateContext *) const, sizeof...(F)+1> kernels =
+		{ &Layout::build_steps_kernel<F>..., &Layout::build_steps_kernel<GENERIC_KERNEL> };
+	return kernels;
+}
+
+void Layout::build_steps(vector<Step> &steps, vector<Checkpoint> &checkpoints, unsigned first_floor, UpdateContext *context) const
+{
+	const auto &kernels = get_build_steps_kernels(make_index_sequence<STEP_FEATURES+1>());
+	unsigned index = (kernel&GENERIC_KERNEL ? STEP_FEATURES+1 : kernel&STEP_FEATURES);
+	(this->*kernels[index])(steps, checkpoints, first_floor, context);
+}
+
+template<unsigned F>
+void Layout::build_steps_kernel(vector<Step> &steps, vector<Checkpoint> &checkpoints, unsigned first_floor, UpdateContext *context) const
 {
 	unsigned cells = data.size();
-	steps.clear();
-	steps.reserve(cells*3);
+	char cell_traps[TrapArray::MAX_FLOORS*5];
+	data.decode(cell_traps);
 
-	uint8_t column_flags[5] = { };
-	for(unsigned i=0; i<cells; ++i)
-		if(data[i]=='L')
-			++column_flags[i%5];
+	uint8_t column_flags[5];
+	get_column_flags(column_flags);
 
-	vector<uint16_t> floor_flags(cells/5, 0);
-	for(unsigned i=0; i<cells; ++i)
+	uint16_t floor_flags[TrapArray::MAX_FLOORS] = { };
+	for(unsigned i=first_floor*5; i<cells; ++i)
 	{
 		unsigned j = i/5;
-		char t = data[i];
+		char t = cell_traps[i];
 		if(t=='F')
 			floor_flags[j] += 1+0x10*column_flags[i%5];
 		else if(t=='S')
 			floor_flags[j] |= 0x08;
 	}
 
-	TrapEffects effects(upgrades, core);
+	Checkpoint resume;
+	if(first_floor)
+		resume = checkpoints[first_floor];
+	steps.resize(resume.step);
+	steps.reserve(cells*3);
+	checkpoints.resize(first_floor);
+	checkpoints.reserve(cells/5+1);
 
-	unsigned chilled = 0;
-	unsigned frozen = 0;
-	unsigned shocked = 0;
-	Fixed<100> damage_multi = 1;
-	unsigned special_multi = 1;
-	unsigned repeat = 1;
-	for(unsigned i=0; i<cells; )
-	{
-		char t = data[i];
-		Step step;
-		step.cell = i;
-		step.trap = t;
-		step.slow = (frozen ? 2 : chilled ? 1 : 0);
-		step.shock = (shocked!=0);
+	FloorBlock *memo = 0;
+	uint64_t memo_mask = 0;
+	if(context && !context->floor_memo.empty())
+	{
+		memo = context->floor_memo.data();
+		memo_mask = context->floor_memo.size()-1;
+	}
 
-		if(t=='Z')
-		{
-			step.direct_damage = (effects.frost_damage*damage_multi).round();
-			chilled = effects.chill_dur*special_multi+1;
-			frozen = 0;
-			repeat = 1;
-		}
-		else if(t=='F')
+	unsigned chilled = resume.chilled;
+	unsigned frozen = resume.frozen;
+	unsigned shocked = resume.shocked;
+	Fixed<100> damage_multi = resume.damage_multi;
+	unsigned special_multi = resume.special_multi;
+	unsigned repeat = resume.repeat;
+	for(unsigned floor=first_floor; floor*5<cells; ++floor)
+	{
+		Checkpoint cp;
+		cp.step = steps.size();
+		cp.chilled = chilled;
+		cp.frozen = frozen;
+		cp.shocked = shocked;
+		cp.repeat = repeat;
+		cp.damage_multi = damage_multi;
+		cp.special_multi = special_multi;
+		checkpoints.push_back(cp);
+
+		/* Damage and special multipliers are those of shock exactly when
+		shocked is nonzero, and repeat follows from chilled and frozen, so they
+		don't need to be part of the key. */
+		FloorBlock *block = 0;
+		uint64_t state = 0;
+		uint64_t columns = 0;
+		if(memo && chilled<0x100 && frozen<0x100 && shocked<0x100)
 		{
-			step.direct_damage = (effects.fire_damage*damage_multi).round();
-			if(floor_flags[i/5]&0x08)
-				step.direct_damage = (step.direct_damage*Fixed<100>(effects.strength_multi)).round();
-			if(chilled && upgrades.frost>=3)
-				step.direct_damage = step.direct_damage*5/4;
-			if(upgrades.lightning>=4)
-				step.direct_damage = (step.direct_damage*Fixed<1000>(1+effects.lightning_column_bonus*column_flags[i%5])).round();
-			if(upgrades.fire>=4)
-				step.culling_strike = true;
+			unsigned first = floor*5;
+			state = data.get_floor(floor)|(chilled<<21)|(uint64_t(frozen)<<29)|(uint64_t(shocked)<<37);
+			if(cell_traps[first]=='P' && first>0)
+				state |= data.get_code(first-1)<<15;
+			if(cell_traps[first+4]=='P' && first+5<cells)
+				state |= data.get_code(first+5)<<18;
+			if(has_feature<F>(LIGHTNING_COLUMNS))
+			{
+				for(unsigned j=0; j<5; ++j)
+					if(cell_traps[first+j]=='F' || cell_traps[first+j]=='P' || cell_traps[first+j]=='S')
+						columns |= uint64_t(column_flags[j])<<(j*8);
+			}
+
+			uint64_t slot = (state^config_hash^(columns*0x9E3779B97F4A7C15ULL))*0xBF58476D1CE4E5B9ULL;
+			block = &memo[(slot>>32)&memo_mask];
+			++context->memo_lookups;
+			if(block->n_steps && block->state==state && block->config_hash==config_hash && block->columns==columns)
+			{
+				++context->memo_hits;
+				for(unsigned j=0; j<block->n_steps; ++j)
+				{
+					steps.push_back(block->steps[j]);
+					steps.back().cell += first;
+				}
+				chilled = block->end_chilled;
+				frozen = block->end_frozen;
+				shocked = block->end_shocked;
+				damage_multi = (shocked ? Fixed<100>(effects.shock_damage_multi) : Fixed<100>(1));
+				special_multi = (shocked ? effects.special_multi : 1);
+				repeat = (frozen ? 3 : chilled ? 2 : 1);
+				continue;
+			}
 		}
-		else if(t=='P')
+
+		for(unsigned i=floor*5; i<floor*5+5; )
 		{
-			step.toxicity = (effects.poison_damage*damage_multi).round();
-			if(upgrades.frost>=4 && i+1<cells && data[i+1]=='Z')
-				step.toxicity *= 4;
-			if(upgrades.poison>=3)
+			char t = cell_traps[i];
+			Step step;
+			step.cell = i;
+			step.trap = t;
+			step.slow = (frozen ? 2 : chilled ? 1 : 0);
+			step.shock = (shocked!=0);
+
+			if(t=='Z')
+			{
+				step.direct_damage = (effects.frost_damage*damage_multi).round();
+				chilled = effects.chill_dur*special_multi+1;
+				frozen = 0;
+				repeat = 1;
+			}
+			else if(t=='F')
+			{
+				step.direct_damage = (effects.fire_damage*damage_multi).round();
+				if(floor_flags[i/5]&0x08)
+					step.direct_damage = (step.direct_damage*Fixed<100>(effects.strength_multi)).round();
+				if(chilled && has_feature<F>(FROST_CHILL_BONUS))
+					step.direct_damage = step.direct_damage*5/4;
+				if(has_feature<F>(LIGHTNING_COLUMNS))
+					step.direct_damage = (step.direct_damage*Fixed<1000>(1+effects.lightning_column_bonus*column_flags[i%5])).round();
+				if(has_feature<F>(FIRE_CULLING))
+					step.culling_strike = true;
+			}
+			else if(t=='P')
+			{
+				step.toxicity = (effects.poison_damage*damage_multi).round();
+				if(has_feature<F>(FROST_POISON_BONUS) && i+1<cells && cell_traps[i+1]=='Z')
+					step.toxicity *= 4;
+				if(has_feature<F>(POISON_ADJACENT))
+				{
+					if(i>0 && cell_traps[i-1]=='P')
+						step.toxicity *= 3;
+					if(i+1<cells && cell_traps[i+1]=='P')
+						step.toxicity *= 3;
+				}
+				if(has_feature<F>(LIGHTNING_COLUMNS))
+					step.toxicity = (step.toxicity*Fixed<1000>(1+effects.lightning_column_bonus*column_flags[i%5])).round();
+			}
+			else if(t=='L')
+			{
+				step.direct_damage = (effects.lightning_damage*damage_multi).round();
+				shocked = effects.shock_dur+1;
+				damage_multi = Fixed<100>(effects.shock_damage_multi);
+				special_multi = effects.special_multi;
+			}
+			else if(t=='S')
+			{
+				uint16_t flags = floor_flags[i/5];
+				step.direct_damage = (effects.fire_damage*(flags&0x07)).round();
+				if(has_feature<F>(LIGHTNING_COLUMNS))
+					step.direct_damage += (effects.fire_damage*Fixed<1000>(effects.lightning_column_bonus)*(flags>>4)).round();
+				step.direct_damage = (step.direct_damage*Fixed<100>(effects.strength_multi)*damage_multi).round();
+				if(chilled && has_feature<F>(FROST_CHILL_BONUS))
+					step.direct_damage = step.direct_damage*5/4;
+			}
+			else if(t=='K')
+			{
+				if(chilled)
+				{
+					chilled = 0;
+					frozen = 5*special_multi+1;
+				}
+				repeat = 1;
+			}
+			else if(t=='C')
+				step.toxic_bonus = Fixed<1600, uint16_t>(effects.condenser_bonus*special_multi);
+
+			if(repeat>1)
+				step.rs_bonus = Fixed<100, uint8_t>(effects.slow_rs_bonus);
+			steps.push_back(step);
+
+			if(shocked && !--shocked)
 			{
-				if(i>0 && data[i-1]=='P')
-					step.toxicity *= 3;
-				if(i+1<cells && data[i+1]=='P')
-					step.toxicity *= 3;
+				damage_multi = 1;
+				special_multi = 1;
 			}
-			if(upgrades.lightning>=4)
-				step.toxicity = (step.toxicity*Fixed<1000>(1+effects.lightning_column_bonus*column_flags[i%5])).round();
+
+			if(repeat && --repeat)
+				continue;
+
+			++i;
+			if(chilled)
+				--chilled;
+			if(frozen)
+				--frozen;
+			repeat = (frozen ? 3 : chilled ? 2 : 1);
 		}
-		else if(t=='L')
+
+		if(block && chilled<0x100 && frozen<0x100 && shocked<0x100)
 		{
-			step.direct_damage = (effects.lightning_damage*damage_multi).round();
-			shocked = effects.shock_dur+1;
-			damage_multi = Fixed<100>(effects.shock_damage_multi);
-			special_multi = effects.special_multi;
+			block->config_hash = config_hash;
+			block->state = state;
+			block->columns = columns;
+			block->n_steps = steps.size()-cp.step;
+			block->end_chilled = chilled;
+			block->end_frozen = frozen;
+			block->end_shocked = shocked;
+			copy(steps.begin()+cp.step, steps.end(), block->steps);
+			for(unsigned j=0; j<block->n_steps; ++j)
+				block->steps[j].cell -= floor*5;
 		}
-		else if(t=='S')
+	}
+
+	Checkpoint end;
+	end.step = steps.size();
+	checkpoints.push_back(end);
+
+	// Track an enemy which is not yet affected by its hp, like simulate with zero hp.
+	Number damage = resume.damage;
+	Number toxicity = resume.toxicity;
+	Number kill_damage = resume.kill_damage;
+	Number boost_hp = resume.boost_hp;
+	Fixed<100, uint16_t> rs_multi = resume.rs_multi;
+	auto cp = checkpoints.begin()+first_floor;
+	for(unsigned i=resume.step; ; ++i)
+	{
+		if(i==cp->step)
 		{
-			uint16_t flags = floor_flags[i/5];
-			step.direct_damage = (effects.fire_damage*(flags&0x07)).round();
-			if(upgrades.lightning>=4)
-				step.direct_damage += (effects.fire_damage*Fixed<1000>(effects.lightning_column_bonus)*(flags>>4)).round();
-			step.direct_damage = (step.direct_damage*Fixed<100>(effects.strength_multi)*damage_multi).round();
-			if(chilled && upgrades.frost>=3)
-				step.direct_damage = step.direct_damage*5/4;
+			cp->damage = damage;
+			cp->toxicity = toxicity;
+			cp->kill_damage = kill_damage;
+			cp->boost_hp = boost_hp;
+			cp->rs_multi = rs_multi;
+			if(++cp==checkpoints.end())
+				break;
 		}
-		else if(t=='K')
+
+		const Step &s = steps[i];
+		damage += s.direct_damage;
+		if(s.culling_strike)
+			kill_damage = max(kill_damage, damage+damage/4);
+		if(s.toxicity)
 		{
-			if(chilled)
-			{
-				chilled = 0;
-				frozen = 5*special_multi+1;
-			}
-			repeat = 1;
+			boost_hp = max(boost_hp, damage*4);
+			toxicity += s.toxicity;
 		}
-		else if(t=='C')
-			step.toxic_bonus = Fixed<1600, uint16_t>(effects.condenser_bonus*special_multi);
+		if(s.toxic_bonus.value)
+			toxicity = (toxicity*Fixed<1600>(1+s.toxic_bonus)).round();
+		damage += toxicity;
+		rs_multi += Fixed<100, uint16_t>(s.rs_bonus);
+		kill_damage = max(kill_damage, damage);
+	}
+}
+
+void Layout::update_steps(UpdateContext &context)
+{
+	unsigned cells = data.size();
+	uint8_t column_flags[5];
+	get_column_flags(column_flags);
+
+	/* Poison traps look at the next cell and lightning traps affect their
+	whole column, so the floor before the first changed cell must also be
+	rebuilt and any change in lightning columns invalidates everything. */
+	unsigned first_floor = 0;
+	if(!checkpoints.empty() && equal(column_flags, column_flags+5, steps_column_flags))
+	{
+		if(clean_cells>=cells)
+			return;
+		if(clean_cells)
+			first_floor = (clean_cells-1)/5;
+	}
+
+	build_steps(steps, checkpoints, first_floor, &context);
+	copy(column_flags, column_flags+5, steps_column_flags);
+	clean_cells = cells;
+	++steps_generation;
+#ifdef WITH_128BIT
+	narrow_steps = check_narrow_steps();
+#endif
+}
 
-		if(repeat>1)
-			step.rs_bonus = Fixed<100, uint8_t>(effects.slow_rs_bonus);
-		steps.push_back(step);
+bool Layout::check_narrow_steps() const
+{
+	/* Follow an enemy which gets the poison boost on every poison trap.  This
+	bounds every value the simulation kernels can reach.  If it stays well
+	within the range of NarrowNumber, including the intermediate products of
+	toxicity multipliers, the narrow kernels produce identical results. */
+	const NarrowNumber limit = NarrowNumber(1)<<60;
+	NarrowNumber damage = 0;
+	NarrowNumber toxicity = 0;
+	for(const Step &s: steps)
+	{
+		if(s.direct_damage>=limit || s.toxicity>=limit)
+			return false;
 
-		if(shocked && !--shocked)
+		// Both stay below the limit between steps, so the sums can't overflow.
+		damage += NarrowNumber(s.direct_damage);
+		toxicity += NarrowNumber(s.toxicity)*5;
+		if(s.toxic_bonus.value)
 		{
-			damage_multi = 1;
-			special_multi = 1;
+			Fixed<1600> product = Number(toxicity)*Fixed<1600>(1+s.toxic_bonus);
+			if(product.value>=Number(limit)*8)
+				return false;
+			toxicity = product.round();
 		}
+		damage += toxicity;
+		if(damage>=limit)
+			return false;
+	}
 
-		if(repeat && --repeat)
-			continue;
+	return true;
+}
 
-		++i;
-		if(chilled)
-			--chilled;
-		if(frozen)
-			--frozen;
-		repeat = (frozen ? 3 : chilled ? 2 : 1);
+Fixed<10, uint16_t> Layout::get_fire_kill_rs_multi() const
+{
+	if(upgrades.fire>=9)
+		return 1.5;
+	else if(upgrades.fire>=7)
+		return 1.2;
+	else
+		return 1;
+}
+
+Layout::SimResult Layout::simulate(const vector<Step> &steps, const vector<Checkpoint> &checkpoints, Number hp, bool stop_early, vector<SimDetail> *detail) const
+{
+	if(kernel&GENERIC_KERNEL)
+		return simulate_kernel<GENERIC_KERNEL, Number>(steps, checkpoints, hp, stop_early, detail);
+#ifdef WITH_128BIT
+	else if(narrow_steps && &steps==&this->steps && !detail)
+	{
+		if(kernel&POISON_BOOST)
+			return simulate_kernel<POISON_BOOST, NarrowNumber>(steps, checkpoints, hp, stop_early, detail);
+		else
+			return simulate_kernel<0, NarrowNumber>(steps, checkpoints, hp, stop_early, detail);
 	}
+#endif
+	else if(kernel&POISON_BOOST)
+		return simulate_kernel<POISON_BOOST, Number>(steps, checkpoints, hp, stop_early, detail);
+	else
+		return simulate_kernel<0, Number>(steps, checkpoints, hp, stop_early, detail);
 }
 
-Layout::SimResult Layout::simulate(const vector<Step> &steps, Number hp, bool stop_early, vector<SimDetail> *detail) const
+template<unsigned F, typename T>
+Layout::SimResult Layout::simulate_kernel(const vector<Step> &steps, const vector<Checkpoint> &checkpoints, Number hp_in, bool stop_early, vector<SimDetail> *detail) const
 {
 	SimResult result;
-	result.sim_hp = hp;
-	result.max_hp = number_max;
+	result.sim_hp = hp_in;
 
 	if(detail)
 	{
@@ -469,35 +948,58 @@ Layout::SimResult Layout::simulate(const vector<Step> &steps, Number hp, bool st
 		detail->reserve(steps.size());
 	}
 
-	Fixed<10, uint16_t> fire_kill_rs_multi = 1;
-	if(upgrades.fire>=9)
-		fire_kill_rs_multi = 1.5;
-	else if(upgrades.fire>=7)
-		fire_kill_rs_multi = 1.2;
+	Fixed<10, uint16_t> fire_kill_rs_multi = get_fire_kill_rs_multi();
 
-	Number kill_damage = 0;
-	Number toxicity = 0;
+	T hp = to_kernel<T>(hp_in);
+	T damage = 0;
+	T max_hp = T(-1);
+	T kill_damage = 0;
+	T toxicity = 0;
 	Fixed<100, uint16_t> rs_multi = 1;
-	for(const auto &s: steps)
+	auto begin = steps.begin();
+	if(!detail)
+	{
+		// Skip floors where the enemy has not been affected by its hp yet.
+		const Checkpoint *resume = 0;
+		for(const auto &c: checkpoints)
+		{
+			if(c.kill_damage>=hp_in || (has_feature<F>(POISON_BOOST) && c.boost_hp>=hp_in))
+				break;
+			resume = &c;
+		}
+
+		if(resume)
+		{
+			damage = resume->damage;
+			result.steps_taken = resume->step;
+			kill_damage = resume->kill_damage;
+			toxicity = resume->toxicity;
+			rs_multi = resume->rs_multi;
+			begin += resume->step;
+		}
+	}
+
+	for(auto i=begin; i!=steps.end(); ++i)
 	{
-		result.damage += s.direct_damage;
+		const Step &s = *i;
+		damage += T(s.direct_damage);
 		if(s.culling_strike)
-			kill_damage = max(kill_damage, result.damage+result.damage/4);
+			kill_damage = max(kill_damage, damage+damage/4);
 		if(s.toxicity)
 		{
-			if(upgrades.poison>=5 && hp && result.damage*4>=hp)
+			if(has_feature<F>(POISON_BOOST) && hp && damage*4>=hp)
 			{
-				toxicity += s.toxicity*5;
-				result.max_hp = min(result.max_hp, result.damage*4);
+				toxicity += T(s.toxicity)*5;
+				max_hp = min(max_hp, damage*4);
 			}
 			else
-				toxicity += s.toxicity;
+				toxicity += T(s.toxicity);
 		}
 		if(s.toxic_bonus.value)
-			toxicity = (toxicity*Fixed<1600>(1+s.toxic_bonus)).round();
-		result.damage += toxicity;
+			toxicity = (toxicity*Fixed<1600, T>(1+s.toxic_bonus)).round();
+		damage += toxicity;
 		rs_multi += Fixed<100, uint16_t>(s.rs_bonus);
-		kill_damage = max(kill_damage, result.damage);
+		kill_damage = max(kill_damage, damage);
 
 		if(detail)
 		{
@@ -507,7 +1009,7 @@ Layout::SimResult Layout::simulate(const vector<Step> &steps, Number hp, bool st
 			if(kill_damage>=hp)
 				sd.hp_left = 0;
 			else
-				sd.hp_left = hp-result.damage;
+				sd.hp_left = hp-damage;
 			detail->push_back(sd);
 		}
 
@@ -516,7 +1018,7 @@ Layout::SimResult Layout::simulate(const vector<Step> &steps, Number hp, bool st
 			++result.steps_taken;
 			if(kill_damage>=hp)
 			{
-				result.max_hp = min(result.max_hp, kill_damage);
+				max_hp = min(max_hp, kill_damage);
 				result.kill_cell = s.cell;
 				result.runestone_multi = rs_multi;
 				if(s.trap=='F')
@@ -527,25 +1029,142 @@ Layout::SimResult Layout::simulate(const vector<Step> &steps, Number hp, bool st
 		}
 	}
 
-	result.toxicity = toxicity;
-	if(kill_damage>=hp)
-		result.damage = kill_damage;
+	result.max_hp = from_kernel(max_hp);
+	result.damage = from_kernel(kill_damage>=hp ? kill_damage : damage);
+	result.toxicity = from_kernel(toxicity);
 
 	return result;
 }
 
-void Layout::build_results(const vector<Step> &steps, vector<SimResult> &results) const
+void Layout::build_results(vector<SimResult> &results, UpdateContext &context, Number min_hp, Number max_hp) const
 {
+#ifdef WITH_128BIT
+	if(narrow_steps)
+	{
+		build_results_kernel(results, context.narrow_ranges, min_hp, max_hp);
+		return;
+	}
+#endif
+	build_results_kernel(results, context.ranges, min_hp, max_hp);
+}
+
+template<typename T>
+void Layout::build_results_kernel(vector<SimResult> &results, vector<HpRange<T>> &pending, Number min_hp, Number max_hp) const
+{
+	/* Produces the same results as repeatedly simulating with hp set to one
+	past the max_hp of the previous result.  Instead of starting over for each
+	result, a range of hp values is run through the steps and split wherever
+	the poison threshold or kill check has different outcomes for different
+	parts of it.  The upper part of a split is resumed later from the step
+	where it happened.  Lower parts are always processed first, so results
+	come out in order.  Only hp values within the given window are covered. */
 	results.clear();
-	Number hp = 1;
-	for(unsigned i=0; i<10000; ++i)
+
+	Fixed<10, uint16_t> fire_kill_rs_multi = get_fire_kill_rs_multi();
+	bool boost = (upgrades.poison>=5);
+
+	HpRange<T> initial;
+	initial.min_hp = to_kernel<T>(min_hp);
+	initial.max_hp = to_kernel<T>(max_hp);
+	for(const auto &c: checkpoints)
 	{
-		SimResult res = simulate(steps, hp, true);
-		results.push_back(res);
-		hp = res.max_hp+1;
-		if(hp<res.max_hp)
-			return;
+		if(c.kill_damage>=initial.min_hp || (boost && c.boost_hp>=initial.min_hp))
+			break;
+		initial.step = c.step;
+		initial.damage = c.damage;
+		initial.toxicity = c.toxicity;
+		initial.kill_damage = c.kill_damage;
+		initial.rs_multi = c.rs_multi;
+	}
+
+	pending.clear();
+	pending.push_back(initial);
+	unsigned n_steps = steps.size();
+	while(!pending.empty() && results.size()<10000)
+	{
+		HpRange<T> r = pending.back();
+		pending.pop_back();
+
+		bool killed = false;
+		for(unsigned i=r.step; (!killed && i<n_steps); ++i)
+		{
+			const Step &s = steps[i];
+			HpRange<T> before = r;
+
+			r.damage += T(s.direct_damage);
+			if(s.culling_strike)
+				r.kill_damage = max(r.kill_damage, r.damage+r.damage/4);
+			if(s.toxicity)
+			{
+				if(boost && r.damage*4>=r.min_hp)
+				{
+					// Enemies with more hp than this don't get the boost.
+					if(r.damage*4<r.max_hp)
+					{
+						before.step = i;
+						before.min_hp = r.damage*4+1;
+						pending.push_back(before);
+						r.max_hp = r.damage*4;
+					}
+					r.toxicity += T(s.toxicity)*5;
+				}
+				else
+					r.toxicity += T(s.toxicity);
+			}
+			if(s.toxic_bonus.value)
+				r.toxicity = (r.toxicity*Fixed<1600, T>(1+s.toxic_bonus)).round();
+			r.damage += r.toxicity;
+			r.rs_multi += Fixed<100, uint16_t>(s.rs_bonus);
+			r.kill_damage = max(r.kill_damage, r.damage);
+
+			if(r.kill_damage>=r.min_hp)
+			{
+				SimResult res;
+				res.sim_hp = from_kernel(r.min_hp);
+				res.max_hp = from_kernel(min(r.max_hp, r.kill_damage));
+				res.damage = from_kernel(r.kill_damage);
+				res.toxicity = from_kernel(r.toxicity);
+				res.steps_taken = i+1;
+				res.kill_cell = s.cell;
+				res.runestone_multi = r.rs_multi;
+				if(s.trap=='F')
+					res.runestone_multi = (res.runestone_multi*fire_kill_rs_multi).rescale<100>();
+				results.push_back(res);
+
+				// Enemies with more hp than this survive the step.
+				killed = (r.kill_damage>=r.max_hp);
+				r.min_hp = r.kill_damage+1;
+			}
+		}
+
+		if(!killed)
+		{
+			SimResult res;
+			res.sim_hp = from_kernel(r.min_hp);
+			res.max_hp = from_kernel(r.max_hp);
+			res.damage = from_kernel(r.damage);
+			res.toxicity = from_kernel(r.toxicity);
+			res.steps_taken = n_steps;
+			results.push_back(res);
+		}
 	}
+
+	if(results.size()>10000)
+		results.resize(10000);
+}
+
+void Layout::get_hp_window(Fixed<16, unsigned> thrt, Number &min_hp, Number &max_hp)
+{
+	Fixed<1000, unsigned> range = min(max(0.53*thrt.to_real(), 0.15), 0.85);
+	max_hp = 10+(thrt*4).to_real()+pow(1.012, thrt.to_real());
+	min_hp = (max_hp*Fixed<1000>(1-range)).round();
+}
+
+void Layout::find_results(const vector<SimResult> &results, Number min_hp, Number max_hp, unsigned &begin, unsigned &end)
+{
+	// Results are ordered by hp and their ranges don't overlap.
+	begin = partition_point(results.begin(), results.end(), [min_hp](const SimResult &r){ return r.max_hp<min_hp; })-results.begin();
+	end = partition_point(results.begin()+begin, results.end(), [max_hp](const SimResult &r){ return r.sim_hp<max_hp; })-results.begin();
 }
 
 template<typename F>
@@ -554,56 +1173,126 @@ Number Layout::integrate_results(const vector<SimResult> &results, Fixed<16, uns
 	if(results.empty())
 		return 0;
 
-	Fixed<1000, unsigned> range = min(max(0.53*thrt.to_real(), 0.15), 0.85);
-	Number max_hp = 10+(thrt*4).to_real()+pow(1.012, thrt.to_real());
-	Number min_hp = (max_hp*Fixed<1000>(1-range)).round();
+	Number min_hp;
+	Number max_hp;
+	get_hp_window(thrt, min_hp, max_hp);
 
-	for(auto i=results.begin(); (i!=results.end() && i->sim_hp<max_hp); ++i)
+	unsigned begin;
+	unsigned end;
+	find_results(results, min_hp, max_hp, begin, end);
+	for(unsigned i=begin; i<end; ++i)
 	{
-		if(i->max_hp<min_hp)
-			continue;
-
-		Number low = max(min_hp, i->sim_hp);
-		Number high = min(max_hp, i->max_hp);
-		func(*i, low, high);
+		const SimResult &r = results[i];
+		func(r, max(min_hp, r.sim_hp), min(max_hp, r.max_hp));
 	}
 
 	return max_hp+1-min_hp;
 }
 
 void Layout::update(UpdateMode mode)
+{
+	UpdateContext context;
+	update(mode, context);
+}
+
+void Layout::update(UpdateMode mode, UpdateContext &context)
 {
 	update_cost();
 	if(mode==COST_ONLY)
 		return;
+	else if(mode==UPPER_BOUND)
+	{
+		update_bounds();
+		return;
+	}
+	else if(mode==FAST || mode==EXACT_DAMAGE)
+	{
+		/* These modes don't compute income.  Clear it so that a bound or the
+		values of another mode can't be taken for the layout's own. */
+		threat = 0;
+		rs_per_sec = 0;
+		rs_per_sec_low = 0;
+		rs_per_sec_high = 0;
+		rs_per_enemy = 0;
+	}
 
-	vector<Step> steps;
-	build_steps(steps);
-	vector<SimResult> results;
+	/* Only the values computed by the requested mode are cached, so a hit
+	leaves the layout in the same state as a full update would.  Skipping the
+	step update is fine since clean_cells still records the modified cells. */
+	uint64_t cache_key = 0;
+	if(context.cache)
+	{
+		cache_key = get_hash()^(mode*0xD6E8FEB86659FD93ULL);
+		++context.cache_lookups;
+		LayoutCache::Values values;
+		if(context.cache->lookup(cache_key, values))
+		{
+			++context.cache_hits;
+			damage = values.damage;
+			if(mode==FULL || mode==APPROX_INCOME)
+			{
+				threat = Fixed<16, unsigned>::from_raw(values.threat);
+				rs_per_sec = values.rs_per_sec;
+				rs_per_sec_low = values.rs_per_sec_low;
+				rs_per_sec_high = values.rs_per_sec_high;
+				rs_per_enemy = values.rs_per_enemy;
+			}
+			return;
+		}
+	}
+
+	update_steps(context);
 	if(mode==FAST)
-		update_damage(steps, 10);
-	else if(mode>FAST)
+		update_damage(10);
+	else if(mode==APPROX_INCOME)
+	{
+		update_damage(10);
+		estimate_income(context);
+	}
+	else if(mode==EXACT_DAMAGE)
 	{
-		build_results(steps, results);
-		update_damage(results);
-		if(mode==FULL)
+		build_results(context.results, context);
+		update_damage(context.results);
+	}
+	else if(mode==FULL)
+	{
+		/* Kill results are monotonic in hp, so bisecting all the way finds the
+		same damage as the full results would.  Threat and runestones then only
+		need results within the hp window of the threat search. */
+		update_damage(numeric_limits<unsigned>::max());
+		update_threat(context);
+		update_runestones(context.results);
+	}
+
+	if(context.cache)
+	{
+		LayoutCache::Values values = { };
+		values.damage = damage;
+		if(mode==FULL || mode==APPROX_INCOME)
 		{
-			update_threat(results);
-			update_runestones(results);
+			values.threat = threat.value;
+			values.rs_per_sec = rs_per_sec;
+			values.rs_per_sec_low = rs_per_sec_low;
+			values.rs_per_sec_high = rs_per_sec_high;
+			values.rs_per_enemy = rs_per_enemy;
 		}
+		context.cache->store(cache_key, values);
 	}
 }
 
-void Layout::update_damage(const vector<Step> &steps, unsigned accuracy)
+void Layout::update_damage(unsigned accuracy)
 {
-	damage = simulate(steps, 0, false).damage;
+	// The final checkpoint holds the result of simulating with zero hp.
+	damage = checkpoints.back().kill_damage;
 	if(upgrades.poison>=5)
 	{
-		Number high = simulate(steps, damage, false).damage;
+		/* Probes are simulated one at a time.  Running several hp values in
+		lockstep was no faster, since the step loop doesn't vectorize. */
+		Number high = simulate(steps, checkpoints, damage, false).damage;
 		for(unsigned i=0; (i<accuracy && damage+1<high); ++i)
 		{
 			Number mid = (damage+high)/2;
-			SimResult res = simulate(steps, mid, false);
+			SimResult res = simulate(steps, checkpoints, mid, false);
 			if(res.kill_cell>=0)
 				damage = res.max_hp;
 			else
@@ -636,105 +1325,331 @@ void Layout::update_damage(const vector<SimResult> &results)
 
 void Layout::update_cost()
 {
-	Number fire_cost = 100;
-	Number frost_cost = 100;
-	Number poison_cost = 500;
-	Number lightning_cost = 1000;
-	Number strength_cost = 3000;
-	Number condenser_cost = 6000;
-	Number knowledge_cost = 9000;
-	Number max_cost = number_max;
+	/* The cost of a trap only depends on how many of the same type were placed
+	before it, so the total can be summed from cumulative costs per type.  If
+	a sum overflows, the cost saturates to the maximum. */
+	struct CostTable
+	{
+		Number totals[8][TrapArray::MAX_FLOORS*5+1];
+
+		CostTable()
+		{
+			Number max_cost = number_max;
+			for(unsigned t=1; t<8; ++t)
+			{
+				char trap = TrapArray::letters[t];
+				Number trap_cost = (trap=='F' || trap=='Z' ? 100 : trap=='P' ? 500 : trap=='L' ? 1000 :
+					trap=='S' ? 3000 : trap=='C' ? 6000 : 9000);
+				totals[t][0] = 0;
+				for(unsigned i=1; i<=TrapArray::MAX_FLOORS*5; ++i)
+				{
+					Number prev = totals[t][i-1];
+					totals[t][i] = (prev+trap_cost<prev ? max_cost : prev+trap_cost);
+
+					if(trap=='F')
+						trap_cost = trap_cost*3/2;
+					else if(trap=='Z')
+						trap_cost *= 5;
+					else if(trap=='P')
+						trap_cost = trap_cost*7/4;
+					else if(trap=='L')
+						trap_cost *= 3;
+					else
+						trap_cost = (trap_cost<max_cost/100 ? trap_cost*100 : max_cost);
+				}
+			}
+		}
+	};
+
+	static const CostTable table;
 	cost = 0;
-	for(char t: data)
+	for(unsigned t=1; t<8; ++t)
+	{
+		Number trap_total = table.totals[t][data.get_count(t)];
+		cost += trap_total;
+		if(cost<trap_total)
+		{
+			cost = number_max;
+			break;
+		}
+	}
+}
+
+void Layout::update_bounds()
+{
+	/* Go through the cells once, visiting each one as many times as slows
+	could make the enemy stay there.  Shocks are assumed to be active after the
+	first lightning trap and poison is always boosted.  Every value only grows
+	with these, so no enemy can take more damage or give more runestones. */
+	unsigned cells = data.size();
+	char cell_traps[TrapArray::MAX_FLOORS*5];
+	data.decode(cell_traps);
+
+	uint8_t column_flags[5];
+	get_column_flags(column_flags);
+
+	uint16_t floor_flags[TrapArray::MAX_FLOORS] = { };
+	for(unsigned i=0; i<cells; ++i)
 	{
-		Number prev_cost = cost;
+		char t = cell_traps[i];
 		if(t=='F')
+			floor_flags[i/5] += 1+0x10*column_flags[i%5];
+		else if(t=='S')
+			floor_flags[i/5] |= 0x08;
+	}
+
+	/* Slows and shocks last for a number of cells, or steps in the case of
+	shocks.  Each cell takes at least one step, so the counts of cells which
+	may be affected are upper bounds. */
+	unsigned features = get_kernel_features(upgrades);
+	unsigned boost = (features&POISON_BOOST ? 5 : 1);
+	const Number limit = number_max>>16;
+	unsigned chilled = 0;
+	unsigned frozen = 0;
+	unsigned shocked = 0;
+	unsigned slowed_steps = 0;
+	Number total_damage = 0;
+	Number toxicity = 0;
+	for(unsigned i=0; (i<cells && total_damage<limit); ++i)
+	{
+		char t = cell_traps[i];
+		// Lightning traps may be visited again while shocked by themselves.
+		Fixed<100> damage_multi = 1;
+		unsigned special_multi = 1;
+		if(shocked || t=='L')
 		{
-			cost += fire_cost;
-			fire_cost = fire_cost*3/2;
+			damage_multi = max(Fixed<100>(effects.shock_damage_multi), Fixed<100>(1));
+			special_multi = max(effects.special_multi, 1U);
 		}
-		else if(t=='Z')
+
+		Number direct_damage = 0;
+		Number step_toxicity = 0;
+		Fixed<1600, uint16_t> toxic_bonus = 0;
+		if(t=='Z')
+			direct_damage = (effects.frost_damage*damage_multi).round();
+		else if(t=='F')
 		{
-			cost += frost_cost;
-			frost_cost *= 5;
+			direct_damage = (effects.fire_damage*damage_multi).round();
+			if(floor_flags[i/5]&0x08)
+				direct_damage = (direct_damage*Fixed<100>(effects.strength_multi)).round();
+			if(chilled && (features&FROST_CHILL_BONUS))
+				direct_damage = direct_damage*5/4;
+			if(features&LIGHTNING_COLUMNS)
+				direct_damage = (direct_damage*Fixed<1000>(1+effects.lightning_column_bonus*column_flags[i%5])).round();
 		}
 		else if(t=='P')
 		{
-			cost += poison_cost;
-			poison_cost = poison_cost*7/4;
+			step_toxicity = (effects.poison_damage*damage_multi).round();
+			if((features&FROST_POISON_BONUS) && i+1<cells && cell_traps[i+1]=='Z')
+				step_toxicity *= 4;
+			if(features&POISON_ADJACENT)
+			{
+				if(i>0 && cell_traps[i-1]=='P')
+					step_toxicity *= 3;
+				if(i+1<cells && cell_traps[i+1]=='P')
+					step_toxicity *= 3;
+			}
+			if(features&LIGHTNING_COLUMNS)
+				step_toxicity = (step_toxicity*Fixed<1000>(1+effects.lightning_column_bonus*column_flags[i%5])).round();
+			step_toxicity *= boost;
 		}
 		else if(t=='L')
-		{
-			cost += lightning_cost;
-			lightning_cost *= 3;
-		}
+			direct_damage = (effects.lightning_damage*damage_multi).round();
 		else if(t=='S')
 		{
-			cost += strength_cost;
-			strength_cost = (strength_cost<max_cost/100 ? strength_cost*100 : max_cost);
+			uint16_t flags = floor_flags[i/5];
+			direct_damage = (effects.fire_damage*(flags&0x07)).round();
+			if(features&LIGHTNING_COLUMNS)
+				direct_damage += (effects.fire_damage*Fixed<1000>(effects.lightning_column_bonus)*(flags>>4)).round();
+			direct_damage = (direct_damage*Fixed<100>(effects.strength_multi)*damage_multi).round();
+			if(chilled && (features&FROST_CHILL_BONUS))
+				direct_damage = direct_damage*5/4;
 		}
 		else if(t=='C')
+			toxic_bonus = Fixed<1600, uint16_t>(effects.condenser_bonus*special_multi);
+
+		// Frost and knockback traps reset the repeat count on the first visit.
+		unsigned visits = (t=='Z' || t=='K' ? 1 : frozen ? 3 : chilled ? 2 : 1);
+		slowed_steps += visits-1;
+		for(unsigned j=0; j<visits; ++j)
 		{
-			cost += condenser_cost;
-			condenser_cost = (condenser_cost<max_cost/100 ? condenser_cost*100 : max_cost);
+			total_damage += direct_damage;
+			toxicity += step_toxicity;
+			if(toxic_bonus.value)
+				toxicity = (toxicity*Fixed<1600>(1+toxic_bonus)).round();
+			total_damage += toxicity;
 		}
-		else if(t=='K')
+
+		if(toxicity>=limit)
+			total_damage = limit;
+
+		bool was_chilled = chilled;
+		chilled -= (chilled>0);
+		frozen -= (frozen>0);
+		shocked -= (shocked>0);
+		if(t=='Z')
 		{
-			cost += knowledge_cost;
-			knowledge_cost = (knowledge_cost<max_cost/100 ? knowledge_cost*100 : max_cost);
+			chilled = effects.chill_dur*special_multi;
+			frozen = 0;
 		}
-
-		if(cost<prev_cost)
+		else if(t=='K' && was_chilled)
 		{
-			cost = max_cost;
-			break;
+			chilled = 0;
+			frozen = max(frozen, 5*special_multi);
 		}
+		else if(t=='L')
+			shocked = effects.shock_dur;
 	}
-}
 
-void Layout::update_threat(const vector<SimResult> &results)
-{
-	if(!damage)
+	rs_per_sec_low = 0;
+	if(total_damage>=limit)
 	{
-		threat = 1;
+		damage = number_max;
+		rs_per_enemy = number_max;
+		rs_per_sec = number_max;
+		rs_per_sec_high = number_max;
 		return;
 	}
 
-	unsigned cells = data.size();
-	unsigned floors = cells/5;
+	damage = (features&FIRE_CULLING ? total_damage+total_damage/4 : total_damage);
 
+	/* Threat is searched upwards from a starting point derived from damage.
+	At low damage the starting point is not defined and the search starts from
+	zero. */
 	static double log_base = log(1.012);
-	Fixed<16, unsigned> low(log(damage-4*log(static_cast<double>(damage))/log_base)/log_base);
-	Fixed<16, unsigned> high = low+64;
+	double start = damage-4*log(static_cast<double>(damage))/log_base;
+	double thrt = (start>1 ? log(start)/log_base : 0)+65;
+	double max_hp = 10+thrt*4+pow(1.012, thrt);
+	/* Slow bonuses are exact multiples of 1%, but the simulation rounds the
+	fire kill multiplier to the nearest 1%, which may add up to 0.005. */
+	double rs_multi = (1+effects.slow_rs_bonus.to_real()*slowed_steps)*get_fire_kill_rs_multi().to_real()+0.01;
+	double per_enemy = (ceil(max_hp/600)+floor(thrt/20))*pow(1.00116, thrt)*rs_multi;
+	if(upgrades.poison>=6)
+		per_enemy = max(per_enemy, static_cast<double>(toxicity)/10);
+	/* The exact calculation truncates each yield and the average, which only
+	lowers them, and rounds the core bonus to nearest, which may add 0.5.  The
+	relative margin covers floating point error in the expressions above, which
+	is many orders of magnitude smaller.  Another unit covers truncating the
+	bound itself. */
+	unsigned core_scale = 100*Core::value_scale;
+	per_enemy = per_enemy*(core_scale+core.runestones)/core_scale*1.001+2;
 
-	while(low+1<high)
+	if(per_enemy>=static_cast<double>(limit))
+	{
+		rs_per_enemy = number_max;
+		rs_per_sec = number_max;
+	}
+	else
 	{
-		threat = (low+high+1)/2;
+		// Steps taken never count as less than the capacity, so this holds up to rounding.
+		rs_per_enemy = per_enemy;
+		rs_per_sec = rs_per_enemy/3+1;
+	}
+	rs_per_sec_high = rs_per_sec;
+}
+
+void Layout::update_threat(UpdateContext &context)
+{
+	/* The search below doesn't assign threat for every damage value.  Start
+	from the same state as a fresh layout, so that values left by an earlier
+	approximate update can't leak into the result. */
+	threat = 0;
+	rs_per_sec = 0;
+
+	vector<SimResult> &results = context.results;
+	Number min_hp = 1;
+	Number max_hp = 0;
+	if(damage)
+	{
+		unsigned floors = data.size()/5;
+
+		static double log_base = log(1.012);
+		Fixed<16, unsigned> low(log(damage-4*log(static_cast<double>(damage))/log_base)/log_base);
+		Fixed<16, unsigned> high = low+64;
 
-		static Number bias = number_max/2;
-		Number change = bias;
-		integrate_results(results, threat, [&change, cells, floors](const SimResult &r, Number low_hp, Number high_hp)
+		/* The search only probes threats between low and high.  The hp window
+		grows with threat, except that its relative size changes at low
+		threats, where results are simply built from the start. */
+		if(low+1<high)
 		{
-			if(r.kill_cell>=0)
-				change += (cells-r.kill_cell+4)/5*(high_hp+1-low_hp);
-			else
+			Number unused;
+			if(low.floor()>=2)
+				get_hp_window(low, min_hp, unused);
+			get_hp_window(high, unused, max_hp);
+			build_results(results, context, min_hp, max_hp);
+		}
+
+		/* Results which are entirely within the window of a threat contribute
+		a fixed amount, so a prefix sum lets each probe only evaluate the
+		results at the edges of the window.  The sums wrap around just like the
+		change itself. */
+		vector<Number> &sums = context.threat_sums;
+		sums.resize(results.size()+1);
+		sums[0] = 0;
+		for(unsigned i=0; i<results.size(); ++i)
+			sums[i+1] = sums[i]+get_threat_change(results[i], results[i].sim_hp, results[i].max_hp, floors);
+
+		while(low+1<high)
+		{
+			threat = (low+high+1)/2;
+
+			static Number bias = number_max/2;
+			Number change = bias;
+			if(!results.empty())
 			{
-				unsigned n = (low_hp*115-r.damage*100-1)/(low_hp*15);
-				while(low_hp<high_hp && n<6)
-				{
-					Number step_hp = (r.damage*100-1)/(100-n*15);
-					change -= floors*n*(min(step_hp, high_hp)+1-low_hp);
-					++n;
-					low_hp = step_hp+1;
-				}
+				Number window_min;
+				Number window_max;
+				get_hp_window(threat, window_min, window_max);
+
+				unsigned begin;
+				unsigned end;
+				find_results(results, window_min, window_max, begin, end);
+				// Results between these are entirely within the window.
+				unsigned inner_begin = max<unsigned>(begin, partition_point(results.begin(), results.end(), [window_min](const SimResult &r){ return r.sim_hp<window_min; })-results.begin());
+				unsigned inner_end = min<unsigned>(end, partition_point(results.begin(), results.end(), [window_max](const SimResult &r){ return r.max_hp<=window_max; })-results.begin());
+				if(inner_begin>=inner_end)
+					inner_begin = inner_end = end;
+
+				for(unsigned i=begin; i<inner_begin; ++i)
+					change += get_threat_change(results[i], max(window_min, results[i].sim_hp), min(window_max, results[i].max_hp), floors);
+				change += sums[inner_end]-sums[inner_begin];
+				for(unsigned i=inner_end; i<end; ++i)
+					change += get_threat_change(results[i], max(window_min, results[i].sim_hp), min(window_max, results[i].max_hp), floors);
 			}
-		});
 
-		if(change>bias)
-			low = threat;
-		else
-			high = threat;
+			if(change>bias)
+				low = threat;
+			else
+				high = threat;
+		}
+	}
+	else
+		threat = 1;
+
+	// Runestones are integrated over the window of the final threat.
+	Number threat_min_hp;
+	Number threat_max_hp;
+	get_hp_window(threat, threat_min_hp, threat_max_hp);
+	if(threat_min_hp<min_hp || threat_max_hp>max_hp)
+		build_results(results, context, threat_min_hp, threat_max_hp);
+}
+
+Number Layout::get_threat_change(const SimResult &r, Number low_hp, Number high_hp, unsigned floors)
+{
+	// Killed enemies raise threat, ones which leak through lower it.
+	if(r.kill_cell>=0)
+		return (floors*5-r.kill_cell+4)/5*(high_hp+1-low_hp);
+
+	Number change = 0;
+	unsigned n = (low_hp*115-r.damage*100-1)/(low_hp*15);
+	while(low_hp<high_hp && n<6)
+	{
+		Number step_hp = (r.damage*100-1)/(100-n*15);
+		change -= floors*n*(min(step_hp, high_hp)+1-low_hp);
+		++n;
+		low_hp = step_hp+1;
 	}
+	return change;
 }
 
 void Layout::update_runestones(const vector<SimResult> &results)
@@ -744,18 +1659,27 @@ void Layout::update_runestones(const vector<SimResult> &results)
 	Fixed<16> steps_taken = 0;
 	double threat_multi = pow(1.00116, threat.to_real());
 
-	Number hp_range = integrate_results(results, threat, [this, &runestones, &steps_taken, threat_multi](const SimResult &r, Number low_hp, Number high_hp)
+	auto add_kill = [&runestones, threat_multi](auto low_hp, auto high_hp, double rs_multi, unsigned threat_term)
+	{
+		double multi = threat_multi*rs_multi;
+		auto low_step = (low_hp+599)/600;
+		auto high_step = (high_hp+599)/600;
+		runestones.add((low_step+threat_term)*multi, low_step*600-low_hp);
+		runestones.add((high_step+threat_term)*multi, high_hp+1-(high_step-1)*600);
+		if(high_step>low_step)
+			runestones.add(((low_step+high_step-1)/2+threat_term)*multi, (high_step-1-low_step)*600);
+	};
+
+	Number hp_range = integrate_results(results, threat, [this, &runestones, &steps_taken, &add_kill](const SimResult &r, Number low_hp, Number high_hp)
 	{
 		if(r.damage>=r.sim_hp)
 		{
-			double multi = threat_multi*r.runestone_multi.to_real();
-			Number low_step = (low_hp+599)/600;
-			Number high_step = (high_hp+599)/600;
+			// Divisions are much faster in narrow arithmetic, which nearly all hp values fit in.
 			unsigned threat_term = (threat/20).floor();
-			runestones.add((low_step+threat_term)*multi, low_step*600-low_hp);
-			runestones.add((high_step+threat_term)*multi, high_hp+1-(high_step-1)*600);
-			if(high_step>low_step)
-				runestones.add(((low_step+high_step-1)/2+threat_term)*multi, (high_step-1-low_step)*600);
+			if(sizeof(Number)>sizeof(NarrowNumber) && high_hp>=(Number(1)<<63))
+				add_kill(low_hp, high_hp, r.runestone_multi.to_real(), threat_term);
+			else
+				add_kill(NarrowNumber(low_hp), NarrowNumber(high_hp), r.runestone_multi.to_real(), threat_term);
 		}
 		else if(upgrades.poison>=6)
 			runestones.add(r.toxicity/10, high_hp+1-low_hp);
@@ -775,18 +1699,180 @@ void Layout::update_runestones(const vector<SimResult> &results)
 	}
 	else
 		rs_per_sec = 0;
+
+	rs_per_sec_low = rs_per_sec;
+	rs_per_sec_high = rs_per_sec;
+}
+
+void Layout::estimate_income(UpdateContext &context)
+{
+	/* The final threat tends to be where the top of the hp window is a fairly
+	constant factor above damage. */
+	static double log_base = log(1.012);
+	double estimate = (damage>1 ? log(static_cast<double>(damage))/log_base-12 : 0);
+	threat = max(estimate, 1.0);
+
+	Number min_hp;
+	Number max_hp;
+	get_hp_window(threat, min_hp, max_hp);
+
+	/* Runestones and steps taken are integrated over the hp window with the
+	trapezoidal rule, using enemies with evenly spaced hp including both ends of
+	the window. */
+	unsigned n_samples = context.income_samples;
+	vector<Number> &hp = context.sample_hp;
+	vector<SimResult> &results = context.results;
+	hp.resize(n_samples);
+	results.resize(n_samples);
+	Number spacing = (max_hp-min_hp)/(n_samples-1);
+	for(unsigned i=0; i+1<n_samples; ++i)
+		hp[i] = min_hp+spacing*i;
+	hp.back() = max_hp;
+	for(unsigned i=0; i<n_samples; ++i)
+		results[i] = simulate(steps, checkpoints, hp[i], false);
+
+	double threat_multi = pow(1.00116, threat.to_real());
+	unsigned threat_term = (threat/20).floor();
+	double fire_multi = get_fire_kill_rs_multi().to_real();
+	double max_multi = checkpoints.back().rs_multi.to_real()*fire_multi;
+	auto kill_yield = [threat_term, threat_multi](Number h, double multi){ return ((h+599)/600+threat_term)*threat_multi*multi; };
+	auto leak_yield = [this](const SimResult &r){ return (upgrades.poison>=6 ? static_cast<double>(r.toxicity/10) : 0.0); };
+	auto base_multi = [this, fire_multi](const SimResult &r){ return r.runestone_multi.to_real()/(data[r.kill_cell]=='F' ? fire_multi : 1); };
+
+	/* An enemy with more hp is killed later, if at all, and accumulates less
+	toxicity.  This bounds the values between two samples at the estimated
+	threat.  The exact threat may differ, so the resulting spread is not a
+	bound of the exact income. */
+	double runestones[3] = { };
+	double steps_taken[3] = { };
+	for(unsigned i=0; i+1<n_samples; ++i)
+	{
+		const SimResult &a = results[i];
+		const SimResult &b = results[i+1];
+		bool a_killed = (a.damage>=a.sim_hp);
+		bool b_killed = (b.damage>=b.sim_hp);
+		double a_yield = (a_killed ? kill_yield(a.sim_hp, a.runestone_multi.to_real()) : leak_yield(a));
+		double b_yield = (b_killed ? kill_yield(b.sim_hp, b.runestone_multi.to_real()) : leak_yield(b));
+		double low;
+		double high;
+		if(b_killed)
+		{
+			low = kill_yield(a.sim_hp, base_multi(a));
+			high = kill_yield(b.sim_hp, base_multi(b)*fire_multi);
+		}
+		else if(!a_killed)
+		{
+			low = leak_yield(b);
+			high = leak_yield(a);
+		}
+		else
+		{
+			low = min(kill_yield(a.sim_hp, base_multi(a)), leak_yield(b));
+			high = max(kill_yield(b.sim_hp, max_multi), leak_yield(a));
+		}
+
+		double width = b.sim_hp-a.sim_hp;
+		runestones[0] += (a_yield+b_yield)/2*width;
+		runestones[1] += low*width;
+		runestones[2] += high*width;
+		steps_taken[0] += (a.steps_taken+b.steps_taken)/2.0*width;
+		steps_taken[1] += a.steps_taken*width;
+		steps_taken[2] += b.steps_taken*width;
+	}
+
+	double total_width = max<double>(max_hp-min_hp, 1);
+	unsigned core_scale = 100*Core::value_scale;
+	double core_multi = static_cast<double>(core_scale+core.runestones)/core_scale;
+	double capacity = (1+(data.size()+1)/2)*3;
+	Number income[3];
+	for(unsigned i=0; i<3; ++i)
+	{
+		double per_enemy = runestones[i]/total_width*core_multi;
+		if(!i)
+			rs_per_enemy = per_enemy;
+		// Fewer steps taken means more enemies per second.
+		double steps_per_enemy = max(steps_taken[i ? 3-i : 0]/total_width, capacity);
+		income[i] = per_enemy*capacity/steps_per_enemy/3;
+	}
+
+	rs_per_sec = income[0];
+	rs_per_sec_low = income[1];
+	rs_per_sec_high = income[2];
+}
+
+void Layout::record_undo(UndoLog &log) const
+{
+	log.data = data;
+	log.core = core;
+	log.effects = effects;
+	log.config_hash = config_hash;
+	log.clean_cells = clean_cells;
+	log.steps_generation = steps_generation;
+	log.cycle = cycle;
+	log.damage = damage;
+	log.cost = cost;
+	log.rs_per_sec = rs_per_sec;
+	log.rs_per_sec_low = rs_per_sec_low;
+	log.rs_per_sec_high = rs_per_sec_high;
+	log.rs_per_enemy = rs_per_enemy;
+	log.threat = threat;
+}
+
+void Layout::undo(const UndoLog &log)
+{
+	data = log.data;
+	core = log.core;
+	effects = log.effects;
+	config_hash = log.config_hash;
+	clean_cells = (steps_generation==log.steps_generation ? log.clean_cells : 0);
+	cycle = log.cycle;
+	damage = log.damage;
+	cost = log.cost;
+	rs_per_sec = log.rs_per_sec;
+	rs_per_sec_low = log.rs_per_sec_low;
+	rs_per_sec_high = log.rs_per_sec_high;
+	rs_per_enemy = log.rs_per_enemy;
+	threat = log.threat;
+}
+
+void Layout::load_state(const UndoLog &log)
+{
+	/* Like undo, but steps rebuilt since the state was recorded are kept up to
+	the first cell where the traps differ, unless the core changed the effects
+	of every trap.  This lets one layout evaluate a series of candidates
+	recorded from it. */
+	unsigned clean = log.clean_cells;
+	if(steps_generation!=log.steps_generation)
+		clean = (config_hash==log.config_hash ? min(clean_cells, data.get_first_difference(log.data)) : 0);
+	undo(log);
+	clean_cells = clean;
 }
 
 void Layout::cross_from(const Layout &other, Random &random)
 {
 	unsigned cells = min(data.size(), other.data.size());
 	for(unsigned i=0; i<cells; ++i)
-		if(random()&1)
-			data[i] = other.data[i];
+		if(random()&1 && data.get_code(i)!=other.data.get_code(i))
+		{
+			data.set_code(i, other.data.get_code(i));
+			clean_cells = min(clean_cells, i);
+		}
 }
 
-void Layout::mutate(MutateMode mode, unsigned count, Random &random, unsigned cyc)
+void Layout::mutate(MutateMode mode, unsigned count, Random &random, unsigned cyc, const double *contribution)
 {
+	/* Biased mutations use all operations, but pick the lower contributing of
+	two random cells or floors as the one to replace or move.  Contributions
+	are only exact for the first operation.  Without them, cells are picked
+	uniformly. */
+	bool biased = (mode==BIASED && contribution);
+	double floor_contribution[TrapArray::MAX_FLOORS];
+	if(biased)
+	{
+		for(unsigned i=0; i*5<data.size(); ++i)
+			floor_contribution[i] = contribution[i*5]+contribution[i*5+1]+contribution[i*5+2]+contribution[i*5+3]+contribution[i*5+4];
+	}
+
 	unsigned cells = data.size();
 	unsigned locality = (cells>=10 ? random()%(cells*2/15) : 0);
 	unsigned base = 0;
@@ -806,7 +1892,7 @@ void Layout::mutate(MutateMode mode, unsigned count, Random &random, unsigned cy
 		unsigned op = 0;  // REPLACE_ONLY
 		if(mode==PERMUTE_ONLY)
 			op = 1+random()%4;
-		else if(mode==ALL_MUTATIONS)
+		else if(mode==ALL_MUTATIONS || mode==BIASED)
 			op = random()%8;
 
 		unsigned t = 1+random()%traps_count;
@@ -814,29 +1900,44 @@ void Layout::mutate(MutateMode mode, unsigned count, Random &random, unsigned cy
 			t += (t-1)/2;
 		if(!upgrades.lightning && t>=4)
 			++t;
-		char trap = traps[t];
 
 		if(op==0)  // replace
-			data[base+random()%cells] = trap;
+		{
+			unsigned pos = base+random()%cells;
+			if(biased)
+			{
+				unsigned other = base+random()%cells;
+				if(contribution[other]<contribution[pos])
+					pos = other;
+			}
+			data.set_code(pos, t);
+			clean_cells = min(clean_cells, pos);
+		}
 		else if(op==1 || op==2 || op==5)  // swap, rotate, insert
 		{
 			unsigned pos = base+random()%cells;
+			if(biased)
+			{
+				unsigned other = base+random()%cells;
+				if(contribution[other]<contribution[pos])
+					pos = other;
+			}
 			unsigned end = base+random()%(cells-1);
 			if(end>=pos)
 				++end;
+			clean_cells = min(clean_cells, min(pos, end));
 
 			if(op==1)
-				swap(data[pos], data[end]);
+			{
+				unsigned code = data.get_code(pos);
+				data.set_code(pos, data.get_code(end));
+				data.set_code(end, code);
+			}
 			else
 			{
-				if(op==2)
-					trap = data[end];
-
-				for(unsigned j=end; j>pos; --j)
-					data[j] = data[j-1];
-				for(unsigned j=end; j<pos; ++j)
-					data[j] = data[j+1];
-				data[pos] = trap;
+				data.rotate(pos, end);
+				if(op==5)
+					data.set_code(pos, t);
 			}
 		}
 		else if(cells>=10)  // floor operations
@@ -847,35 +1948,36 @@ void Layout::mutate(MutateMode mode, unsigned count, Random &random, unsigned cy
 			if(end>=pos)
 				++end;
 
-			pos = base+pos*5;
-			end = base+end*5;
+			pos += base/5;
+			end += base/5;
+			// Rotate, duplicate and copy overwrite the floor at end.
+			if(biased)
+			{
+				unsigned other = base/5+random()%floors;
+				if(other!=pos && floor_contribution[other]<floor_contribution[end])
+					end = other;
+			}
+			clean_cells = min(clean_cells, min(pos, end)*5);
 
 			if(op==3 || op==6)  // rotate, duplicate
 			{
-				char floor[5];
-				for(unsigned j=0; j<5; ++j)
-					floor[j] = data[end+j];
+				unsigned floor = data.get_floor(end);
 
 				for(unsigned j=end; j>pos; --j)
-					data[j+4] = data[j-1];
+					data.set_floor(j, data.get_floor(j-1));
 				for(unsigned j=end; j<pos; ++j)
-					data[j] = data[j+5];
+					data.set_floor(j, data.get_floor(j+1));
 
 				if(op==3)
-				{
-					for(unsigned j=0; j<5; ++j)
-						data[pos+j] = floor[j];
-				}
+					data.set_floor(pos, floor);
 			}
 			else if(op==7)  // copy
-			{
-				for(unsigned j=0; j<5; ++j)
-					data[end+j] = data[pos+j];
-			}
+				data.set_floor(end, data.get_floor(pos));
 			else if(op==4)  // swap
 			{
-				for(unsigned j=0; j<5; ++j)
-					swap(data[pos+j], data[end+j]);
+				unsigned floor = data.get_floor(pos);
+				data.set_floor(pos, data.get_floor(end));
+				data.set_floor(end, floor);
 			}
 		}
 	}
@@ -883,20 +1985,64 @@ void Layout::mutate(MutateMode mode, unsigned count, Random &random, unsigned cy
 	cycle = cyc;
 }
 
-bool Layout::is_valid() const
+void Layout::get_cell_contributions(double *contribution, UpdateContext &context)
 {
-	unsigned cells = data.size();
-	bool have_strength = false;
-	for(unsigned i=0; i<cells; ++i)
+	/* Split the damage dealt to an enemy which survives the whole spire
+	between the cells.  Toxicity counts for every step after it was gained.
+	Extra steps caused by slowing go to the frost or kill trap responsible,
+	and the extra damage from shock to the lightning trap.  Layouts whose
+	values came from the cache or which got a new core still have older steps,
+	so those are brought up to date first. */
+	update_steps(context);
+
+	fill(contribution, contribution+data.size(), 0.0);
+	double shock_share = 1-100.0/effects.shock_damage_multi.value;
+	double toxicity = 0;
+	unsigned slow_cell = 0;
+	unsigned shock_cell = 0;
+	unsigned n_steps = steps.size();
+	for(unsigned i=0; i<n_steps; ++i)
 	{
-		if(i%5==0)
-			have_strength = false;
-		if(data[i]=='S')
+		const Step &s = steps[i];
+		double ticks = n_steps-i;
+		unsigned cell = s.cell;
+		if(i>0 && steps[i-1].cell==s.cell)
+			cell = slow_cell;
+
+		double gain = static_cast<double>(s.direct_damage)+static_cast<double>(s.toxicity)*ticks;
+		if(s.shock)
 		{
-			if(have_strength)
-				return false;
-			have_strength = true;
+			contribution[shock_cell] += gain*shock_share;
+			gain -= gain*shock_share;
+		}
+		contribution[cell] += gain;
+
+		toxicity += static_cast<double>(s.toxicity);
+		if(s.toxic_bonus.value)
+		{
+			double bonus = toxicity*s.toxic_bonus.value/1600;
+			contribution[cell] += bonus*ticks;
+			toxicity += bonus;
 		}
+
+		if(s.trap=='Z' || (s.trap=='K' && s.slow==1))
+			slow_cell = s.cell;
+		else if(s.trap=='L')
+			shock_cell = s.cell;
+	}
+}
+
+bool Layout::is_valid() const
+{
+	// Each floor can only have one strength tower.
+	unsigned n_words = data.get_word_count();
+	unsigned strength = TrapArray::encode('S');
+	for(unsigned i=0; i<n_words; ++i)
+	{
+		uint64_t mask = data.match(i, strength);
+		for(unsigned j=0; j<TrapArray::FLOORS_PER_WORD; ++j, mask>>=TrapArray::FLOOR_BITS)
+			if(__builtin_popcountll(mask&0x7FFF)>1)
+				return false;
 	}
 
 	return true;
@@ -905,9 +2051,10 @@ bool Layout::is_valid() const
 void Layout::debug(Number hp) const
 {
 	vector<Step> steps;
-	build_steps(steps);
+	vector<Checkpoint> checkpoints;
+	build_steps(steps, checkpoints, 0);
 	vector<SimDetail> detail;
-	SimResult result = simulate(steps, hp, false, &detail);
+	SimResult result = simulate(steps, checkpoints, hp, false, &detail);
 
 	cout << "Enemy HP: " << hp << endl;
 
@@ -945,9 +2092,10 @@ void Layout::debug(Number hp) const
 void Layout::build_cell_info(vector<CellInfo> &info, Number hp) const
 {
 	vector<Step> steps;
-	build_steps(steps);
+	vector<Checkpoint> checkpoints;
+	build_steps(steps, checkpoints, 0);
 	vector<SimDetail> detail;
-	simulate(steps, hp, false, &detail);
+	simulate(steps, checkpoints, hp, false, &detail);
 
 	info.clear();
 	info.resize(data.size());
@@ -966,6 +2114,82 @@ void Layout::build_cell_info(vector<CellInfo> &info, Number hp) const
 }
 
 
+Layout::UndoLog::UndoLog():
+	effects(TrapUpgrades(), Core()),
+	config_hash(0),
+	clean_cells(0),
+	steps_generation(0),
+	cycle(0),
+	damage(0),
+	cost(0),
+	rs_per_sec(0),
+	rs_per_sec_low(0),
+	rs_per_sec_high(0),
+	rs_per_enemy(0),
+	threat(0)
+{ }
+
+
+LayoutBatch::LayoutBatch():
+	count(0),
+	kept_count(0)
+{ }
+
+void LayoutBatch::add(const Layout &layout)
+{
+	if(count>=candidates.size())
+		candidates.emplace_back();
+	layout.record_undo(candidates[count++]);
+}
+
+void LayoutBatch::keep(const Layout &layout)
+{
+	if(kept_count>=kept.size())
+		kept.emplace_back();
+	kept[kept_count++] = layout;
+}
+
+
+Layout::UpdateContext::UpdateContext():
+	income_samples(5),
+	cache(0),
+	cache_lookups(0),
+	cache_hits(0),
+	memo_lookups(0),
+	memo_hits(0)
+{ }
+
+void Layout::UpdateContext::set_income_samples(unsigned n)
+{
+	if(n<2)
+		throw invalid_argument("Layout::UpdateContext::set_income_samples");
+	income_samples = n;
+}
+
+void Layout::UpdateContext::flush_cache_stats()
+{
+	if(cache)
+		cache->add_stats(cache_lookups, cache_hits);
+	cache_lookups = 0;
+	cache_hits = 0;
+}
+
+void Layout::UpdateContext::set_floor_memo(unsigned bits)
+{
+	if(bits>24)
+		throw invalid_argument("Layout::UpdateContext::set_floor_memo");
+	floor_memo.assign((bits ? 1U<<bits : 0), FloorBlock());
+}
+
+void Layout::UpdateContext::take_memo_stats(unsigned long &lookups, unsigned long &hits)
+{
+	lookups = memo_lookups;
+	hits = memo_hits;
+	memo_lookups = 0;
+	memo_hits = 0;
+}
+
+
 Layout::Step::Step():
 	trap(0),
 	slow(0),
@@ -978,6 +2202,45 @@ Layout::Step::Step():
 { }
 
 
+Layout::FloorBlock::FloorBlock():
+	config_hash(0),
+	state(0),
+	columns(0),
+	n_steps(0),
+	end_chilled(0),
+	end_frozen(0),
+	end_shocked(0)
+{ }
+
+
+Layout::Checkpoint::Checkpoint():
+	step(0),
+	chilled(0),
+	frozen(0),
+	shocked(0),
+	repeat(1),
+	damage_multi(1),
+	special_multi(1),
+	damage(0),
+	toxicity(0),
+	kill_damage(0),
+	boost_hp(0),
+	rs_multi(1)
+{ }
+
+
+template<typename T>
+Layout::HpRange<T>::HpRange():
+	step(0),
+	min_hp(1),
+	max_hp(T(-1)),
+	damage(0),
+	toxicity(0),
+	kill_damage(0),
+	rs_multi(1)
+{ }
+
+
 Layout::SimResult::SimResult():
 	sim_hp(0),
 	max_hp(0),
@@ -1,9 +1,12 @@
 #ifndef SPIRELAYOUT_H_
 #define SPIRELAYOUT_H_
 
+#include <array>
 #include <cstdint>
+#include <utility>
 #include <vector>
 #include "fixedpoint.h"
+#include "spirecache.h"
 #include "spirecore.h"
 #include "types.h"
 
@@ -51,8 +54,106 @@ struct TrapEffects
 	Fixed<100, unsigned> slow_rs_bonus;
 
 	TrapEffects(const TrapUpgrades &, const Core &);
+
+	static TrapEffects get(const TrapUpgrades &, const Core &);
+};
+
+/* Traps of a layout, packed into three bits per cell.  Each word holds a whole
+number of floors, so a floor can be moved as a single field.  A Zobrist hash of
+the cells and the number of each trap are kept up to date as cells are
+modified. */
+class TrapArray
+{
+public:
+	enum
+	{
+		MAX_FLOORS = 32,
+		FLOORS_PER_WORD = 4,
+		CELLS_PER_WORD = FLOORS_PER_WORD*5,
+		FLOOR_BITS = 15
+	};
+
+	static const char letters[];
+
+private:
+	std::uint64_t words[MAX_FLOORS/FLOORS_PER_WORD];
+	unsigned cells;
+	std::uint64_t hash;
+	std::uint8_t counts[8];
+
+	static const std::array<std::uint64_t, MAX_FLOORS*5*8> zobrist_keys;
+
+public:
+	TrapArray();
+
+	void assign(const std::string &, unsigned);
+	unsigned size() const { return cells; }
+	unsigned get_word_count() const { return (cells+CELLS_PER_WORD-1)/CELLS_PER_WORD; }
+
+	char operator[](unsigned i) const { return letters[get_code(i)]; }
+	unsigned get_code(unsigned i) const { return (words[i/CELLS_PER_WORD]>>(i%CELLS_PER_WORD*3))&7; }
+	void set(unsigned, char);
+	void set_code(unsigned, unsigned);
+	unsigned get_floor(unsigned f) const { return (words[f/FLOORS_PER_WORD]>>(f%FLOORS_PER_WORD*FLOOR_BITS))&0x7FFF; }
+	void set_floor(unsigned, unsigned);
+	void rotate(unsigned, unsigned);
+	std::uint64_t match(unsigned, unsigned) const;
+	std::uint64_t get_hash() const { return hash; }
+	unsigned get_count(unsigned c) const { return counts[c]; }
+	unsigned get_first_difference(const TrapArray &) const;
+private:
+	void put_code(unsigned, unsigned);
+	std::uint64_t hash_range(unsigned, unsigned) const;
+	static std::uint64_t get_zobrist_key(unsigned i, unsigned c) { return zobrist_keys[i*8+c]; }
+
+public:
+	void decode(char *) const;
+	std::string str() const;
+
+	static unsigned encode(char);
 };
 
+inline void TrapArray::put_code(unsigned i, unsigned c)
+{
+	std::uint64_t &word = words[i/CELLS_PER_WORD];
+	unsigned shift = i%CELLS_PER_WORD*3;
+	word = (word&~(std::uint64_t(7)<<shift)) | (std::uint64_t(c)<<shift);
+}
+
+inline void TrapArray::set_code(unsigned i, unsigned c)
+{
+	unsigned old = get_code(i);
+	hash ^= get_zobrist_key(i, old)^get_zobrist_key(i, c);
+	--counts[old];
+	++counts[c];
+	put_code(i, c);
+}
+
+inline void TrapArray::set_floor(unsigned f, unsigned c)
+{
+	std::uint64_t &word = words[f/FLOORS_PER_WORD];
+	unsigned shift = f%FLOORS_PER_WORD*FLOOR_BITS;
+	unsigned old = (word>>shift)&0x7FFF;
+	for(unsigned i=0; i<5; ++i)
+	{
+		unsigned old_code = (old>>i*3)&7;
+		unsigned code = (c>>i*3)&7;
+		hash ^= get_zobrist_key(f*5+i, old_code)^get_zobrist_key(f*5+i, code);
+		--counts[old_code];
+		++counts[code];
+	}
+	word = (word&~(std::uint64_t(0x7FFF)<<shift)) | (std::uint64_t(c)<<shift);
+}
+
+inline std::uint64_t TrapArray::match(unsigned w, unsigned code) const
+{
+	// Returns the lowest bit of each cell in the word that holds the code.
+	const std::uint64_t low_bits = 0x0249249249249249ULL&((std::uint64_t(1)<<CELLS_PER_WORD*3)-1);
+	std::uint64_t x = words[w]^(low_bits*code);
+	x |= (x>>1)|(x>>2);
+	return ~x&low_bits;
+}
+
 struct CellInfo
 {
 	char trap;
@@ -72,19 +173,38 @@ public:
 		COST_ONLY,
 		FAST,
 		EXACT_DAMAGE,
-		FULL
+		FULL,
+		UPPER_BOUND,
+		APPROX_INCOME
 	};
 
 	enum MutateMode
 	{
 		REPLACE_ONLY,
 		PERMUTE_ONLY,
-		ALL_MUTATIONS
+		ALL_MUTATIONS,
+		BIASED
 	};
 
-	static const char traps[];
+	static const char *const traps;
 
 private:
+	/* Upgrade thresholds which change how steps are built or simulated.  The
+	kernels are instantiated for every combination so that these checks are
+	resolved at compile time.  The generic kernel checks them at run time and
+	serves as the reference. */
+	enum KernelFeature
+	{
+		FIRE_CULLING = 1,
+		FROST_CHILL_BONUS = 2,
+		FROST_POISON_BONUS = 4,
+		POISON_ADJACENT = 8,
+		LIGHTNING_COLUMNS = 16,
+		STEP_FEATURES = 31,
+		POISON_BOOST = 32,
+		GENERIC_KERNEL = 64
+	};
+
 	struct SimResult
 	{
 		Number sim_hp;
@@ -113,6 +233,47 @@ private:
 		Step();
 	};
 
+	/* Snapshot of the state at the start of a floor.  Builder state is used to
+	resume building steps from the floor.  Simulator state is the one of an
+	enemy which has not yet been killed or affected by hp-dependent effects. */
+	struct Checkpoint
+	{
+		unsigned step;
+		unsigned chilled;
+		unsigned frozen;
+		unsigned shocked;
+		unsigned repeat;
+		Fixed<100> damage_multi;
+		unsigned special_multi;
+		Number damage;
+		Number toxicity;
+		Number kill_damage;
+		Number boost_hp;
+		Fixed<100, std::uint16_t> rs_multi;
+
+		Checkpoint();
+	};
+
+	/* A range of enemy hp values which have taken identical paths so far.  The
+	number type is the one used by the result building kernel. */
+	template<typename T>
+	struct HpRange
+	{
+		unsigned step;
+		T min_hp;
+		T max_hp;
+		T damage;
+		T toxicity;
+		T kill_damage;
+		Fixed<100, std::uint16_t> rs_multi;
+
+		HpRange();
+	};
+
+	/* Simulation kernels run with 64-bit numbers when the steps are known not
+	to overflow them, since 128-bit arithmetic is considerably slower. */
+	typedef std::uint64_t NarrowNumber;
+
 	struct SimDetail
 	{
 		Number damage_taken;
@@ -120,15 +281,109 @@ private:
 		Number hp_left;
 	};
 
+	/* Steps of one floor, built from a given builder state.  Builder state at
+	the start of a floor is determined by the chilled, frozen and shocked
+	counters, so together with the traps, their neighbours and lightning
+	columns that affect them, these form the key.  Cells are relative to the
+	start of the floor. */
+	struct FloorBlock
+	{
+		std::uint64_t config_hash;
+		std::uint64_t state;
+		std::uint64_t columns;
+		std::uint8_t n_steps;
+		std::uint8_t end_chilled;
+		std::uint8_t end_frozen;
+		std::uint8_t end_shocked;
+		Step steps[15];
+
+		FloorBlock();
+	};
+
+public:
+	/* Buffers used while updating a layout.  Passing the same context to
+	repeated updates lets them run without allocating memory.  If a cache is
+	set, results are looked up from and stored into it. */
+	class UpdateContext
+	{
+	private:
+		std::vector<SimResult> results;
+		std::vector<HpRange<Number>> ranges;
+		std::vector<HpRange<NarrowNumber>> narrow_ranges;
+		std::vector<Number> threat_sums;
+		std::vector<Number> sample_hp;
+		unsigned income_samples;
+		LayoutCache *cache;
+		unsigned long cache_lookups;
+		unsigned long cache_hits;
+		std::vector<FloorBlock> floor_memo;
+		unsigned long memo_lookups;
+		unsigned long memo_hits;
+
+		friend class Layout;
+
+	public:
+		UpdateContext();
+
+		void set_income_samples(unsigned);
+		void set_cache(LayoutCache *c) { cache = c; }
+		void flush_cache_stats();
+		void set_floor_memo(unsigned);
+		void take_memo_stats(unsigned long &, unsigned long &);
+	};
+
+	/* State which is changed by mutations, core changes and the update modes
+	which don't touch steps.  Restoring it undoes such changes without copying
+	the steps of the layout.  If steps were rebuilt in between, they no longer
+	match the restored traps and are marked for a full rebuild. */
+	class UndoLog
+	{
+	private:
+		TrapArray data;
+		Core core;
+		TrapEffects effects;
+		std::uint64_t config_hash;
+		unsigned clean_cells;
+		unsigned steps_generation;
+		unsigned cycle;
+		Number damage;
+		Number cost;
+		Number rs_per_sec;
+		Number rs_per_sec_low;
+		Number rs_per_sec_high;
+		Number rs_per_enemy;
+		Fixed<16, unsigned> threat;
+
+		friend class Layout;
+
+	public:
+		UndoLog();
+	};
+
+private:
 	TrapUpgrades upgrades;
 	Core core;
-	std::string data;
+	TrapEffects effects;
+	TrapArray data;
+	std::vector<Step> steps;
+	std::vector<Checkpoint> checkpoints;
+	std::uint8_t steps_column_flags[5];
+	unsigned clean_cells;
+	// Incremented whenever steps are rebuilt.
+	unsigned steps_generation;
+	bool narrow_steps;
 	Number damage;
 	Number cost;
 	Number rs_per_sec;
+	/* Spread of an approximate income.  It is not a bound, since the threat
+	used for the approximation is itself only estimated. */
+	Number rs_per_sec_low;
+	Number rs_per_sec_high;
 	Number rs_per_enemy;
 	Fixed<16, unsigned> threat;
 	unsigned cycle;
+	std::uint64_t config_hash;
+	unsigned kernel;
 
 public:
 	Layout();
@@ -137,29 +392,61 @@ public:
 	void set_core(const Core &);
 	void set_traps(const std::string &, unsigned = 0);
 	const TrapUpgrades &get_upgrades() const { return upgrades; }
-	const std::string &get_traps() const { return data; }
+	std::string get_traps() const { return data.str(); }
+	unsigned get_floors() const { return data.size()/5; }
+	char get_trap(unsigned i) const { return data[i]; }
 	unsigned get_tower_count() const;
 	const Core &get_core() const { return core; }
+	std::uint64_t get_hash() const;
+	void use_generic_kernel();
 private:
-	void build_steps(std::vector<Step> &) const;
-	SimResult simulate(const std::vector<Step> &, Number, bool, std::vector<SimDetail> * = 0) const;
-	void build_results(const std::vector<Step> &, std::vector<SimResult> &) const;
+	void update_config_hash();
+	static unsigned get_kernel_features(const TrapUpgrades &);
+	template<unsigned F>
+	bool has_feature(KernelFeature f) const { return (F&GENERIC_KERNEL ? get_kernel_features(upgrades)&f : F&f); }
+	void get_column_flags(std::uint8_t *) const;
+	void build_steps(std::vector<Step> &, std::vector<Checkpoint> &, unsigned, UpdateContext * = 0) const;
+	template<unsigned F>
+	void build_steps_kernel(std::vector<Step> &, std::vector<Checkpoint> &, unsigned, UpdateContext *) const;
+	template<std::size_t... F>
+	static const std::array<void (Layout::*)(std::vector<Step> &, std::vector<Checkpoint> &, unsigned, UpdateContext *) const, sizeof...(F)+1> &get_build_steps_kernels(std::index_sequence<F...>);
+	void update_steps(UpdateContext &);
+	bool check_narrow_steps() const;
+	Fixed<10, std::uint16_t> get_fire_kill_rs_multi() const;
+	SimResult simulate(const std::vector<Step> &, const std::vector<Checkpoint> &, Number, bool, std::vector<SimDetail> * = 0) const;
+	template<unsigned F, typename T>
+	SimResult simulate_kernel(const std::vector<Step> &, const std::vector<Checkpoint> &, Number, bool, std::vector<SimDetail> *) const;
+	void build_results(std::vector<SimResult> &, UpdateContext &, Number = 1, Number = number_max) const;
+	template<typename T>
+	void build_results_kernel(std::vector<SimResult> &, std::vector<HpRange<T>> &, Number, Number) const;
+	static void get_hp_window(Fixed<16, unsigned>, Number &, Number &);
+	static void find_results(const std::vector<SimResult> &, Number, Number, unsigned &, unsigned &);
 	template<typename F>
 	Number integrate_results(const std::vector<SimResult> &, Fixed<16, unsigned>, const F &) const;
 public:
 	void update(UpdateMode);
+	void update(UpdateMode, UpdateContext &);
 private:
-	void update_damage(const std::vector<Step> &, unsigned);
+	void update_damage(unsigned);
 	void update_damage(const std::vector<SimResult> &);
 	void update_cost();
-	void update_threat(const std::vector<SimResult> &);
+	void update_bounds();
+	void update_threat(UpdateContext &);
+	static Number get_threat_change(const SimResult &, Number, Number, unsigned);
 	void update_runestones(const std::vector<SimResult> &);
+	void estimate_income(UpdateContext &);
 public:
+	void record_undo(UndoLog &) const;
+	void undo(const UndoLog &);
+	void load_state(const UndoLog &);
 	void cross_from(const Layout &, Random &);
-	void mutate(MutateMode, unsigned, Random &, unsigned);
+	void get_cell_contributions(double *, UpdateContext &);
+	void mutate(MutateMode, unsigned, Random &, unsigned, const double * = 0);
 	Number get_damage() const { return damage; }
 	Number get_cost() const { return cost; }
 	Number get_runestones_per_second() const { return rs_per_sec; }
+	Number get_low_runestones_per_second() const { return rs_per_sec_low; }
+	Number get_high_runestones_per_second() const { return rs_per_sec_high; }
 	Number get_runestones_per_enemy() const { return rs_per_enemy; }
 	unsigned get_threat() const { return threat.round(); }
 	unsigned get_cycle() const { return cycle; }
@@ -168,4 +455,31 @@ public:
 	void build_cell_info(std::vector<CellInfo> &, Number) const;
 };
 
+/* Candidates generated from one base layout.  Only the state recorded by an
+undo log is stored for each, so adding a candidate does not copy any steps.
+Candidates are evaluated one after another by loading them into a single
+layout, which only rebuilds the steps from the first cell that differs from the
+previous candidate.  Candidates worth handing on are copied out with keep.
+Storage is kept between uses, so refilling the batch does not need to
+allocate. */
+class LayoutBatch
+{
+private:
+	std::vector<Layout::UndoLog> candidates;
+	unsigned count;
+	std::vector<Layout> kept;
+	unsigned kept_count;
+
+public:
+	LayoutBatch();
+
+	void clear() { count = 0; kept_count = 0; }
+	void add(const Layout &);
+	unsigned size() const { return count; }
+	void load(unsigned i, Layout &l) const { l.load_state(candidates[i]); }
+	void keep(const Layout &);
+	unsigned get_kept_count() const { return kept_count; }
+	const Layout &get_kept(unsigned i) const { return kept[i]; }
+};
+
 #endif
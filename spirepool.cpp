@@ -1,100 +1,414 @@
 #include "spirepool.h"
 #include "spirelayout.h"
+#include <algorithm>
+#include <limits>
+#include <numeric>
 
 using namespace std;
 
-Pool::Pool(unsigned s, ScoreFunc *f):
+Pool::AdmissionFilter::AdmissionFilter():
+	min_score(0),
+	archive(false)
+{ }
+
+bool Pool::AdmissionFilter::accepts(Number score, Number cost) const
+{
+	if(!snapshot || score<min_score)
+		return false;
+
+	// Costs decrease along with scores, so the last better layout is the cheapest.
+	const vector<Entry> &entries = snapshot->entries;
+	auto i = partition_point(entries.begin(), entries.end(), [score](const Entry &e){ return e.score>score; });
+	return (i==entries.begin() || prev(i)->cost>cost);
+}
+
+bool Pool::AdmissionFilter::accepts(const Entry &entry) const
+{
+	if(archive)
+		return !snapshot->covers(entry);
+	return (snapshot->entries.empty() || accepts(entry.score, entry.cost));
+}
+
+
+Pool::Snapshot::Snapshot():
+	total_score(0),
+	hash_table(1, 0)
+{ }
+
+void Pool::Snapshot::build_score_tree()
+{
+	unsigned count = entries.size();
+	score_tree.resize(count);
+	for(unsigned i=0; i<count; ++i)
+		score_tree[i] = entries[i].score;
+
+	// Each node adds its sum to its parent, which covers a range ending at a higher index.
+	for(unsigned i=1; i<=count; ++i)
+	{
+		unsigned parent = i+(i&-i);
+		if(parent<=count)
+			score_tree[parent-1] += score_tree[i-1];
+	}
+
+	total_score = 0;
+	for(unsigned i=count; i; i&=i-1)
+		total_score += score_tree[i-1];
+}
+
+
+void Pool::Snapshot::build_hash_table()
+{
+	// Keep the table at most half full so that probe sequences stay short.
+	unsigned size = 1;
+	while(size<entries.size()*2)
+		size *= 2;
+	hash_table.assign(size, 0);
+
+	uint64_t mask = size-1;
+	for(const auto &e: entries)
+	{
+		uint64_t h = (e.hash ? e.hash : 1);
+		uint64_t slot = h&mask;
+		while(hash_table[slot])
+			slot = (slot+1)&mask;
+		hash_table[slot] = h;
+	}
+}
+
+void Pool::Snapshot::build_crowding()
+{
+	/* The crowding distance of an entry is the sum over all objectives of the
+	distance between its neighbors, relative to the range of the objective.
+	The extremes of each objective are always kept. */
+	unsigned count = entries.size();
+	crowding.assign(count, 0.0);
+	vector<unsigned> order(count);
+	for(unsigned i=0; i<4; ++i)
+	{
+		iota(order.begin(), order.end(), 0);
+		sort(order.begin(), order.end(), [this, i](unsigned a, unsigned b){ return get_objective(entries[a], i)<get_objective(entries[b], i); });
+
+		double low = get_objective(entries[order.front()], i);
+		double high = get_objective(entries[order.back()], i);
+		crowding[order.front()] = numeric_limits<double>::infinity();
+		crowding[order.back()] = numeric_limits<double>::infinity();
+		if(high<=low)
+			continue;
+
+		for(unsigned j=1; j+1<count; ++j)
+			crowding[order[j]] += (get_objective(entries[order[j+1]], i)-get_objective(entries[order[j-1]], i))/(high-low);
+	}
+}
+
+bool Pool::Snapshot::contains(uint64_t hash) const
+{
+	uint64_t h = (hash ? hash : 1);
+	uint64_t mask = hash_table.size()-1;
+	for(uint64_t slot=h&mask; hash_table[slot]; slot=(slot+1)&mask)
+		if(hash_table[slot]==h)
+			return true;
+	return false;
+}
+
+bool Pool::Snapshot::covers(const Entry &entry) const
+{
+	for(const auto &e: entries)
+		if(Pool::covers(e, entry))
+			return true;
+	return false;
+}
+
+
+Pool::Pool(unsigned s, ScoreFunc *f, bool a):
 	max_size(s),
 	score_func(f),
+	archive(a),
+	snapshot(make_shared<Snapshot>()),
 	isolated_until(0)
 { }
 
 void Pool::reset(ScoreFunc *f)
 {
-	lock_guard<mutex> lock(layouts_mutex);
-	layouts.clear();
+	lock_guard<mutex> lock(write_mutex);
+	atomic_store(&snapshot, shared_ptr<const Snapshot>(make_shared<Snapshot>()));
 	if(f)
 		score_func = f;
 }
 
 void Pool::add_layout(const Layout &layout)
 {
-	lock_guard<mutex> lock(layouts_mutex);
+	// Most layouts are rejected, which only needs the published snapshot.
+	AdmissionFilter filter;
+	get_admission_filter(filter);
+	uint64_t hash = layout.get_hash();
+	if(filter.snapshot->contains(hash))
+		return;
 
-	if(layouts.size()>=max_size && score_func(layout)<score_func(layouts.back()))
+	Entry entry = make_entry(layout, hash);
+	if(!filter.accepts(entry))
 		return;
 
-	Number score = score_func(layout);
-	auto i = layouts.begin();
-	for(; (i!=layouts.end() && score_func(*i)>score); ++i)
-		if(i->get_cost()<=layout.get_cost())
-			return;
-	if(i!=layouts.end() && score_func(*i)==score)
+	entry.layout = make_shared<const Layout>(layout);
+	vector<Entry> candidates(1, move(entry));
+	if(archive)
+		merge_archive(candidates);
+	else
+		merge(candidates);
+}
+
+unsigned Pool::add_layouts(const vector<const Layout *> &layouts)
+{
+	AdmissionFilter filter;
+	get_admission_filter(filter);
+	vector<Entry> candidates;
+	unsigned duplicates = 0;
+	for(const Layout *l: layouts)
 	{
-		*i = layout;
-		++i;
+		uint64_t hash = l->get_hash();
+		if(filter.snapshot->contains(hash))
+		{
+			++duplicates;
+			continue;
+		}
+
+		Entry entry = make_entry(*l, hash);
+		if(filter.accepts(entry))
+		{
+			entry.layout = make_shared<const Layout>(*l);
+			candidates.push_back(move(entry));
+		}
 	}
+
+	if(candidates.empty())
+		return duplicates;
+
+	// Among candidates with equal scores, the cheapest comes first and rejects the rest.
+	sort(candidates.begin(), candidates.end(), [](const Entry &e1, const Entry &e2){ return (e1.score>e2.score || (e1.score==e2.score && e1.cost<e2.cost)); });
+	if(archive)
+		merge_archive(candidates);
 	else
-		layouts.insert(i, layout);
+		merge(candidates);
 
-	while(i!=layouts.end())
+	return duplicates;
+}
+
+Pool::Entry Pool::make_entry(const Layout &layout, uint64_t hash) const
+{
+	Entry entry;
+	entry.score = score_func(layout);
+	entry.cost = layout.get_cost();
+	entry.hash = hash;
+	entry.damage = layout.get_damage();
+	entry.income = layout.get_runestones_per_second();
+	entry.towers = layout.get_tower_count();
+	return entry;
+}
+
+bool Pool::covers(const Entry &e1, const Entry &e2)
+{
+	return (e1.damage>=e2.damage && e1.income>=e2.income && e1.towers>=e2.towers && e1.cost<=e2.cost);
+}
+
+double Pool::get_objective(const Entry &entry, unsigned index)
+{
+	switch(index)
 	{
-		if(i->get_cost()>=layout.get_cost())
-			i = layouts.erase(i);
+	case 0: return entry.damage;
+	case 1: return entry.income;
+	case 2: return entry.towers;
+	default: return -static_cast<double>(entry.cost);
+	}
+}
+
+void Pool::merge(vector<Entry> &candidates)
+{
+	lock_guard<mutex> lock(write_mutex);
+
+	/* Merge the candidates into the entries of the current snapshot, which
+	may be newer than the one they were filtered against.  Since costs must
+	decrease along with scores, each entry is kept if it's cheaper than the
+	last kept one.  A candidate replaces an entry with an equal score. */
+	shared_ptr<const Snapshot> old = snapshot;
+	shared_ptr<Snapshot> snap = make_shared<Snapshot>();
+	vector<Entry> &entries = snap->entries;
+	entries.reserve(min<size_t>(old->entries.size()+candidates.size(), max_size));
+	auto i = old->entries.begin();
+	auto j = candidates.begin();
+	bool changed = false;
+	while((i!=old->entries.end() || j!=candidates.end()) && entries.size()<max_size)
+	{
+		if(j!=candidates.end() && (i==old->entries.end() || j->score>=i->score))
+		{
+			if((!entries.empty() && entries.back().cost<=j->cost) || old->contains(j->hash))
+			{
+				++j;
+				continue;
+			}
+
+			if(i!=old->entries.end() && i->score==j->score)
+				++i;
+			entries.push_back(move(*j));
+			++j;
+			changed = true;
+		}
 		else
+		{
+			if(entries.empty() || entries.back().cost>i->cost)
+				entries.push_back(*i);
 			++i;
+		}
 	}
 
-	if(layouts.size()>max_size)
-		layouts.pop_back();
+	if(!changed)
+		return;
+
+	snap->build_score_tree();
+	snap->build_hash_table();
+	atomic_store(&snapshot, shared_ptr<const Snapshot>(snap));
+}
+
+void Pool::merge_archive(vector<Entry> &candidates)
+{
+	lock_guard<mutex> lock(write_mutex);
+
+	/* A candidate enters the archive if no entry is at least as good in every
+	objective, and removes the entries it is at least as good as. */
+	shared_ptr<const Snapshot> old = snapshot;
+	shared_ptr<Snapshot> snap = make_shared<Snapshot>();
+	vector<Entry> &entries = snap->entries;
+	entries = old->entries;
+	bool changed = false;
+	for(auto &c: candidates)
+	{
+		if(snap->covers(c))
+			continue;
+
+		entries.erase(remove_if(entries.begin(), entries.end(), [&c](const Entry &e){ return covers(c, e); }), entries.end());
+		entries.push_back(move(c));
+		changed = true;
+	}
+
+	if(!changed)
+		return;
+
+	// Keep the entries sorted by score so the best one is still at the front.
+	stable_sort(entries.begin(), entries.end(), [](const Entry &e1, const Entry &e2){ return e1.score>e2.score; });
+
+	snap->build_crowding();
+	if(entries.size()>max_size)
+	{
+		/* Drop the most crowded entries in one pass, as NSGA-II does, and only
+		then compute the distances again for the remaining ones. */
+		const vector<double> &crowding = snap->crowding;
+		unsigned count = entries.size();
+		unsigned excess = count-max_size;
+		vector<unsigned> order(count);
+		iota(order.begin(), order.end(), 0);
+		nth_element(order.begin(), order.begin()+excess, order.end(), [&crowding](unsigned a, unsigned b){ return crowding[a]<crowding[b]; });
+
+		vector<bool> drop(count, false);
+		for(unsigned i=0; i<excess; ++i)
+			drop[order[i]] = true;
+		unsigned kept = 0;
+		for(unsigned i=0; i<count; ++i)
+			if(!drop[i])
+			{
+				if(kept!=i)
+					entries[kept] = move(entries[i]);
+				++kept;
+			}
+		entries.resize(kept);
+
+		snap->build_crowding();
+	}
+
+	snap->build_hash_table();
+	atomic_store(&snapshot, shared_ptr<const Snapshot>(snap));
 }
 
 Layout Pool::get_best_layout() const
 {
-	lock_guard<mutex> lock(layouts_mutex);
-	return layouts.front();
+	return *get_snapshot()->entries.front().layout;
 }
 
 bool Pool::get_best_layout(Layout &layout) const
 {
-	lock_guard<mutex> lock(layouts_mutex);
-	if(score_func(layout)>=score_func(layouts.front()))
+	shared_ptr<const Snapshot> snap = get_snapshot();
+	if(score_func(layout)>=snap->entries.front().score)
 		return false;
-	layout = layouts.front();
+	layout = *snap->entries.front().layout;
 	return true;
 }
 
-Layout Pool::get_random_layout(Random &random) const
+bool Pool::get_best_layout(Layout &layout, ScoreFunc *func) const
 {
-	lock_guard<mutex> lock(layouts_mutex);
-
-	Number total = 0;
-	for(const auto &l: layouts)
-		total += score_func(l);
-
-	if(!total)
+	// Archives are not ordered by any single score, so look at every entry.
+	shared_ptr<const Snapshot> snap = get_snapshot();
+	const Layout *best = 0;
+	Number best_score = func(layout);
+	for(const auto &e: snap->entries)
 	{
-		auto i = layouts.begin();
-		advance(i, random()%layouts.size());
-		return *i;
+		Number score = func(*e.layout);
+		if(score>best_score)
+		{
+			best = e.layout.get();
+			best_score = score;
+		}
 	}
 
-	Number p = ((static_cast<Number>(random())<<32)+random())%total;
-	for(const auto &l: layouts)
+	if(!best)
+		return false;
+	layout = *best;
+	return true;
+}
+
+Layout Pool::get_random_layout(Random &random) const
+{
+	shared_ptr<const Snapshot> snap = get_snapshot();
+
+	unsigned count = snap->entries.size();
+	if(archive)
 	{
-		Number score = score_func(l);
-		if(p<score)
-			return l;
-		p -= score;
+		// Binary tournament, preferring the less crowded part of the front.
+		unsigned i = random()%count;
+		unsigned j = random()%count;
+		return *snap->entries[snap->crowding[i]>=snap->crowding[j] ? i : j].layout;
 	}
 
-	throw logic_error("Spire::get_random_layout");
+	if(!snap->total_score)
+		return *snap->entries[random()%count].layout;
+
+	/* Descend the tree to find the entry where the running total of scores
+	first exceeds p. */
+	Number p = ((static_cast<Number>(random())<<32)+random())%snap->total_score;
+	unsigned pos = 0;
+	unsigned step = 1;
+	while(step*2<=count)
+		step *= 2;
+	for(; step; step/=2)
+		if(pos+step<=count && snap->score_tree[pos+step-1]<=p)
+		{
+			pos += step;
+			p -= snap->score_tree[pos-1];
+		}
+
+	if(pos>=count)
+		throw logic_error("Spire::get_random_layout");
+
+	return *snap->entries[pos].layout;
 }
 
 Number Pool::get_best_score() const
 {
-	lock_guard<mutex> lock(layouts_mutex);
-	return score_func(layouts.front());
+	return get_snapshot()->entries.front().score;
+}
+
+void Pool::get_admission_filter(AdmissionFilter &filter) const
+{
+	filter.snapshot = get_snapshot();
+	filter.archive = archive;
+	const vector<Entry> &entries = filter.snapshot->entries;
+	filter.min_score = (entries.size()>=max_size ? entries.back().score : 0);
 }
 
 void Pool::set_isolated_until(unsigned cycle)
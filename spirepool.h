@@ -2,33 +2,108 @@
 #define SPIREPOOL_H_
 
 #include <atomic>
-#include <list>
+#include <cstdint>
+#include <memory>
 #include <mutex>
+#include <vector>
+#include "spirelayout.h"
 #include "types.h"
 
-class Layout;
-
 class Pool 
 {
 public:
 	typedef Number ScoreFunc(const Layout &);
 
+private:
+	struct Entry
+	{
+		Number score;
+		Number cost;
+		std::uint64_t hash;
+		// Objectives of archives, which keep layouts that no other beats in all of them.
+		Number damage;
+		Number income;
+		unsigned towers;
+		std::shared_ptr<const Layout> layout;
+	};
+
+	/* Contents of a pool at one point in time.  Snapshots are never modified
+	after being published, so readers can use them without locking.  Entries
+	are sorted by descending score.  Costs are descending as well, since a
+	layout is only kept if it's cheaper than all better ones. */
+	struct Snapshot
+	{
+		std::vector<Entry> entries;
+		// Fenwick tree over the scores of entries, for weighted random selection.
+		std::vector<Number> score_tree;
+		Number total_score;
+		// Open addressing table of layout hashes, for rejecting duplicates.
+		std::vector<std::uint64_t> hash_table;
+		// Crowding distances of entries in an archive, for tournament selection.
+		std::vector<double> crowding;
+
+		Snapshot();
+
+		void build_score_tree();
+		void build_hash_table();
+		void build_crowding();
+		bool contains(std::uint64_t) const;
+		bool covers(const Entry &) const;
+	};
+
+public:
+	/* Scores and costs of the layouts in a pool at one point in time.  A
+	layout is only accepted if every layout with a higher score is more
+	expensive, and it beats the worst one when the pool is full.  Archives
+	accept layouts which no existing one is at least as good as in every
+	objective. */
+	class AdmissionFilter
+	{
+	private:
+		std::shared_ptr<const Snapshot> snapshot;
+		Number min_score;
+		bool archive;
+
+		friend class Pool;
+
+		bool accepts(const Entry &) const;
+
+	public:
+		AdmissionFilter();
+
+		// Archives have no single score to compare bounds to, so their filters are always empty.
+		bool empty() const { return archive || !snapshot || snapshot->entries.empty(); }
+		bool accepts(Number, Number) const;
+	};
+
 private:
 	unsigned max_size;
 	ScoreFunc *score_func;
-	std::list<Layout> layouts;
-	mutable std::mutex layouts_mutex;
+	bool archive;
+	std::shared_ptr<const Snapshot> snapshot;
+	std::mutex write_mutex;
 	std::atomic<unsigned> isolated_until;
 
 public:
-	Pool(unsigned, ScoreFunc *);
+	Pool(unsigned, ScoreFunc *, bool = false);
 
 	void reset(ScoreFunc * = 0);
 	void add_layout(const Layout &);
+	unsigned add_layouts(const std::vector<const Layout *> &);
+private:
+	Entry make_entry(const Layout &, std::uint64_t) const;
+	static bool covers(const Entry &, const Entry &);
+	static double get_objective(const Entry &, unsigned);
+	void merge(std::vector<Entry> &);
+	void merge_archive(std::vector<Entry> &);
+	std::shared_ptr<const Snapshot> get_snapshot() const { return std::atomic_load(&snapshot); }
+public:
 	Layout get_best_layout() const;
 	bool get_best_layout(Layout &) const;
+	bool get_best_layout(Layout &, ScoreFunc *) const;
 	Layout get_random_layout(Random &) const;
 	Number get_best_score() const;
+	void get_admission_filter(AdmissionFilter &) const;
 	void set_isolated_until(unsigned);
 	bool check_isolation(unsigned) const;
 
@@ -39,9 +114,9 @@ public:
 template<typename F>
 void Pool::visit_layouts(const F &func) const
 {
-	std::lock_guard<std::mutex> lock(layouts_mutex);
-	for(const auto &layout: layouts)
-		if(!func(layout))
+	std::shared_ptr<const Snapshot> snap = get_snapshot();
+	for(const auto &e: snap->entries)
+		if(!func(*e.layout))
 			return;
 }
 
@@ -0,0 +1,146 @@
+#ifndef WIDEINT_H_
+#define WIDEINT_H_
+
+#include <cstdint>
+#include "types.h"
+
+template<typename T>
+struct HalfWidth;
+
+template<>
+struct HalfWidth<std::uint64_t>
+{ typedef std::uint32_t Type; };
+
+#ifdef WITH_128BIT
+template<>
+struct HalfWidth<Number>
+{ typedef std::uint64_t Type; };
+#endif
+
+/* Unsigned integer with twice the width of T.  Only supports the operations
+needed for computing weighted averages: accumulating products and dividing by
+a single-width number. */
+template<typename T>
+class DoubleWidth
+{
+private:
+	typedef typename HalfWidth<T>::Type Half;
+
+	T high;
+	T low;
+
+	static constexpr unsigned bits = sizeof(T)*8;
+	static constexpr unsigned half_bits = bits/2;
+	static constexpr T half_base = T(1)<<half_bits;
+	static constexpr T half_mask = half_base-1;
+
+public:
+	DoubleWidth(): high(0), low(0) { }
+
+	void add(T);
+	void multiply_add(T, T);
+
+	/* Returns the quotient, saturated to the maximum value of T if it does not
+	fit or the divisor is zero. */
+	T divide(T) const;
+};
+
+template<typename T>
+inline void DoubleWidth<T>::add(T n)
+{
+	low += n;
+	high += (low<n);
+}
+
+template<typename T>
+inline void DoubleWidth<T>::multiply_add(T a, T b)
+{
+	// Each half product fits in T.  Casting the halves lets the compiler use a single widening multiply.
+	T alow = Half(a);
+	T ahigh = a>>half_bits;
+	T blow = Half(b);
+	T bhigh = b>>half_bits;
+	T ll = alow*blow;
+	T lh = alow*bhigh;
+	T hl = ahigh*blow;
+	T hh = ahigh*bhigh;
+	T mid = (ll>>half_bits)+Half(lh)+Half(hl);
+	add((mid<<half_bits)|Half(ll));
+	high += hh+(lh>>half_bits)+(hl>>half_bits)+(mid>>half_bits);
+}
+
+#ifdef __SIZEOF_INT128__
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+template<>
+inline void DoubleWidth<std::uint64_t>::multiply_add(std::uint64_t a, std::uint64_t b)
+{
+	unsigned __int128 p = static_cast<unsigned __int128>(a)*b;
+	add(static_cast<std::uint64_t>(p));
+	high += p>>64;
+}
+#ifdef __GNUC__
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+inline unsigned leading_zeros(std::uint64_t n)
+{
+	return __builtin_clzll(n);
+}
+
+#ifdef WITH_128BIT
+inline unsigned leading_zeros(Number n)
+{
+	if(std::uint64_t high = n>>64)
+		return leading_zeros(high);
+	return 64+leading_zeros(static_cast<std::uint64_t>(n));
+}
+#endif
+
+/* Two-digit long division in base 2^half_bits with a normalized divisor, as
+described in Hacker's Delight (divlu).  Each quotient digit is estimated with a
+single-width division and corrected at most twice. */
+template<typename T>
+inline T DoubleWidth<T>::divide(T divisor) const
+{
+	if(high>=divisor)
+		return T(-1);
+
+	unsigned shift = leading_zeros(divisor);
+	T v = divisor<<shift;
+	T vhigh = v>>half_bits;
+	T vlow = Half(v);
+
+	T u32 = (high<<shift)|(shift ? low>>(bits-shift) : 0);
+	T u10 = low<<shift;
+	T u1 = u10>>half_bits;
+	T u0 = Half(u10);
+
+	T q1 = u32/vhigh;
+	T rem = u32-q1*vhigh;
+	while(q1>=half_base || q1*vlow>(rem<<half_bits)+u1)
+	{
+		--q1;
+		rem += vhigh;
+		if(rem>=half_base)
+			break;
+	}
+
+	T u21 = (u32<<half_bits)+u1-q1*v;
+	T q0 = u21/vhigh;
+	rem = u21-q0*vhigh;
+	while(q0>=half_base || q0*vlow>(rem<<half_bits)+u0)
+	{
+		--q0;
+		rem += vhigh;
+		if(rem>=half_base)
+			break;
+	}
+
+	return (q1<<half_bits)|q0;
+}
+
+#endif
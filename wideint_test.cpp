@@ -0,0 +1,161 @@
+#include <cstdint>
+#include <iostream>
+#include "types.h"
+#include "wideint.h"
+
+using namespace std;
+
+namespace {
+
+/* Double-width arithmetic one bit at a time.  It's far too slow for actual use
+but simple enough to serve as a reference for DoubleWidth. */
+template<typename T>
+struct WideReference
+{
+	static constexpr unsigned bits = sizeof(T)*8;
+
+	T high;
+	T low;
+
+	WideReference(): high(0), low(0) { }
+
+	void add(T);
+	void multiply_add(T, T);
+	T divide(T) const;
+};
+
+template<typename T>
+void WideReference<T>::add(T n)
+{
+	low += n;
+	high += (low<n);
+}
+
+template<typename T>
+void WideReference<T>::multiply_add(T a, T b)
+{
+	for(unsigned i=0; i<bits; ++i)
+		if((b>>i)&1)
+		{
+			add(a<<i);
+			high += (i ? a>>(bits-i) : 0);
+		}
+}
+
+template<typename T>
+T WideReference<T>::divide(T divisor) const
+{
+	if(!divisor || high>=divisor)
+		return T(-1);
+
+	T rem = high;
+	T quotient = 0;
+	for(unsigned i=bits; i--; )
+	{
+		bool carry = rem>>(bits-1);
+		rem = (rem<<1)|((low>>i)&1);
+		quotient <<= 1;
+		if(carry || rem>=divisor)
+		{
+			rem -= divisor;
+			quotient |= 1;
+		}
+	}
+
+	return quotient;
+}
+
+// Mostly values at the edges of the range or of the half-width digits.
+template<typename T>
+T random_operand(Random &random)
+{
+	static constexpr unsigned bits = sizeof(T)*8;
+	static constexpr T half_base = T(1)<<(bits/2);
+
+	T n = 0;
+	for(unsigned i=0; i<bits; i+=16)
+		n = (n<<16)|(random()&0xFFFF);
+
+	switch(random()%8)
+	{
+	case 0:
+		{
+			const T edges[] = { 0, 1, 2, T(-1), T(-2), half_base-1, half_base, half_base+1, T(1)<<(bits-1) };
+			return edges[random()%(sizeof(edges)/sizeof(edges[0]))];
+		}
+	case 1: return T(1)<<(random()%bits);
+	case 2: return (T(1)<<(random()%bits))-1;
+	case 3: return (T(1)<<(random()%bits))+1;
+	case 4: return n>>(random()%bits);
+	case 5: return n|(T(-1)<<(random()%bits));
+	default: return n;
+	}
+}
+
+template<typename T>
+unsigned check_double_width(unsigned n_cases, Random &random)
+{
+	unsigned mismatches = 0;
+	for(unsigned i=0; i<n_cases; ++i)
+	{
+		DoubleWidth<T> wide;
+		WideReference<T> ref;
+#ifdef __SIZEOF_INT128__
+		unsigned __int128 native = 0;
+#endif
+		for(unsigned j=1+random()%3; j; --j)
+		{
+			T a = random_operand<T>(random);
+			if(random()%4)
+			{
+				T b = random_operand<T>(random);
+				wide.multiply_add(a, b);
+				ref.multiply_add(a, b);
+#ifdef __SIZEOF_INT128__
+				native += static_cast<unsigned __int128>(a)*b;
+#endif
+			}
+			else
+			{
+				wide.add(a);
+				ref.add(a);
+#ifdef __SIZEOF_INT128__
+				native += a;
+#endif
+			}
+		}
+
+#ifdef __SIZEOF_INT128__
+		// Validate the reference itself where a native type is available.
+		if(sizeof(T)==8 && (ref.high!=T(native>>32>>32) || ref.low!=T(native)))
+			++mismatches;
+#endif
+
+		/* Divisors just above and at the high half are where the quotient stops
+		fitting and saturation begins. */
+		T divisors[] = { random_operand<T>(random), random_operand<T>(random), ref.high, T(ref.high+1), 0 };
+		for(T d: divisors)
+			if(wide.divide(d)!=ref.divide(d))
+				++mismatches;
+	}
+
+	return mismatches;
+}
+
+}
+
+/* Compares DoubleWidth against a simple bit-by-bit implementation, using random
+operands and edge cases such as zero, one, all ones and powers of two.  Exits
+with a nonzero status on any mismatch. */
+int main()
+{
+	Random random(1);
+	unsigned mismatches = check_double_width<uint64_t>(1000000, random);
+	cout << "64-bit: 1000000 cases, " << mismatches << " mismatches" << endl;
+#ifdef WITH_128BIT
+	unsigned wide_mismatches = check_double_width<Number>(200000, random);
+	cout << "128-bit: 200000 cases, " << wide_mismatches << " mismatches" << endl;
+	mismatches += wide_mismatches;
+#endif
+	return (mismatches ? 1 : 0);
+}